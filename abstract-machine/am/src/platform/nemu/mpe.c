@@ -2,17 +2,48 @@
 #include <stdatomic.h>
 #include <klib-macros.h>
 
+#if defined(__riscv)
+// set by _start, see CONFIG_SMP of NEMU
+int _mpe_nr_cpu = 1;
+void (* volatile _mpe_entry)() = NULL;
+volatile uintptr_t _mpe_stack = 0;
+
+#define MPE_STACK_SIZE 0x8000
+
+void _mpe_start() {
+  _mpe_entry();
+  panic("MPE entry returns");
+}
+#endif
+
 bool mpe_init(void (*entry)()) {
+#if defined(__riscv)
+  // the stacks of the other harts are taken from the end of the heap
+  heap.end = (void *)((uintptr_t)heap.end - (cpu_count() - 1) * MPE_STACK_SIZE);
+  _mpe_stack = (uintptr_t)heap.end;
+  _mpe_entry = entry;
+#endif
   entry();
   panic("MPE entry returns");
 }
 
 int cpu_count() {
+#if defined(__riscv)
+  // NEMU without multiple harts leaves $a1 zero
+  return (_mpe_nr_cpu > 0 ? _mpe_nr_cpu : 1);
+#else
   return 1;
+#endif
 }
 
 int cpu_current() {
+#if defined(__riscv)
+  int id;
+  asm volatile("csrr %0, mhartid" : "=r"(id));
+  return id;
+#else
   return 0;
+#endif
 }
 
 int atomic_xchg(int *addr, int newval) {
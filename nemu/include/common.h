@@ -44,6 +44,11 @@ typedef MUXDEF(PMEM64, uint64_t, uint32_t) paddr_t;
 #define FMT_PADDR MUXDEF(PMEM64, "0x%016" PRIx64, "0x%08" PRIx32)
 typedef uint16_t ioaddr_t;
 
+// the state private to each hart, which runs on its own thread with CONFIG_SMP
+#define HART_LOCAL MUXDEF(CONFIG_SMP, __thread, MACHINE_LOCAL)
+// the state private to each machine, which runs on its own thread with CONFIG_BATCH_RUN
+#define MACHINE_LOCAL MUXDEF(CONFIG_BATCH_RUN, __thread, )
+
 #include <debug.h>
 
 #endif
@@ -18,7 +18,11 @@
 
 #include <common.h>
 
+extern HART_LOCAL int g_hart_id;
+extern MACHINE_LOCAL uint64_t g_nr_guest_inst;
+
 void cpu_exec(uint64_t n);
+void cpu_fast_forward(uint64_t nr_inst, bool by_pc, vaddr_t pc);
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
@@ -24,6 +24,8 @@ void difftest_skip_ref();
 void difftest_skip_dut(int nr_ref, int nr_dut);
 void difftest_set_patch(void (*fn)(void *arg), void *arg);
 void difftest_step(vaddr_t pc, vaddr_t npc);
+void difftest_flush();
+void difftest_log_store(paddr_t addr, int len);
 void difftest_detach();
 void difftest_attach();
 #else
@@ -31,6 +33,7 @@ static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
 static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
 static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
+static inline void difftest_flush() {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
@@ -39,6 +42,10 @@ extern void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direc
 extern void (*ref_difftest_regcpy)(void *dut, bool direction);
 extern void (*ref_difftest_exec)(uint64_t n);
 extern void (*ref_difftest_raise_intr)(uint64_t NO);
+extern void (*ref_difftest_memhash)(const paddr_t *addr, int nr, uint64_t *hash);
+extern void (*ref_difftest_exec_and_regcpy)(uint64_t n, void *buf, uint64_t *dirty_mask);
+extern void (*ref_difftest_exec_to)(uint64_t pc, uint64_t nr_hit);
+extern int (*ref_difftest_storelog)(difftest_store_t *buf, int max);
 
 static inline bool difftest_check_reg(const char *name, vaddr_t pc, word_t ref, word_t dut) {
   if (ref != dut) {
@@ -0,0 +1,46 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_EVENT_H__
+#define __CPU_EVENT_H__
+
+#include <common.h>
+
+typedef void (*event_handler_t)(void *arg);
+
+// the instruction count of the earliest event, checked by cpu_exec()
+extern uint64_t g_event_next_inst;
+
+/* Call `handler' after `delay' instructions, and then every `period'
+ * instructions if `period' is not zero. Return the id of the event. */
+int event_add(uint64_t delay, uint64_t period, event_handler_t handler, void *arg);
+
+/* Call `handler' once when `g_nr_guest_inst' reaches `inst'. The event is
+ * fixed to the instruction, and not moved by event_skip() or event_rebase(). */
+int event_add_at(uint64_t inst, event_handler_t handler, void *arg);
+void event_cancel(int id);
+
+/* Call the handlers of the events which are due. */
+void event_run();
+
+/* Let the time jump to the next event which is not fixed, and return the
+ * number of instructions skipped. The event is then due. */
+uint64_t event_skip();
+
+/* Keep the delays of the events after `g_nr_guest_inst' is changed from
+ * `old_nr_inst', e.g. by restoring a checkpoint. */
+void event_rebase(uint64_t old_nr_inst);
+
+#endif
@@ -0,0 +1,38 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_REPLAY_H__
+#define __DEVICE_REPLAY_H__
+
+#include <common.h>
+
+enum { REPLAY_OFF, REPLAY_RECORD, REPLAY_PLAY };
+enum { INPUT_KEY, INPUT_QUIT, INPUT_RTC };
+
+extern int g_replay_mode;
+
+// the keys and the quit come from the record, and SDL is not used
+static inline bool replay_headless() {
+  return MUXDEF(CONFIG_DEVICE_REPLAY, g_replay_mode == REPLAY_PLAY, false);
+}
+
+/* Write an input to the record, with the current instruction count,
+ * if the inputs are recorded. */
+void replay_log(int type, uint64_t data);
+
+/* Return the RTC value the guest should read, which is `us' unless replaying. */
+uint64_t replay_rtc(uint64_t us);
+
+#endif
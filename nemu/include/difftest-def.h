@@ -23,18 +23,84 @@
 #define __EXPORT __attribute__((visibility("default")))
 enum { DIFFTEST_TO_DUT, DIFFTEST_TO_REF };
 
+/* Version of the REF ABI, returned by `difftest_version()' of REF.
+ * 0 (no `difftest_version()'): memcpy, regcpy, exec, raise_intr and init
+ * 1: difftest_exec_and_regcpy()
+ */
+#define DIFFTEST_ABI_VERSION 1
+
 #if defined(CONFIG_ISA_x86)
+# define DIFFTEST_REG_T uint32_t
 # define DIFFTEST_REG_SIZE (sizeof(uint32_t) * 9) // GPRs + pc
 #elif defined(CONFIG_ISA_mips32)
+# define DIFFTEST_REG_T uint32_t
 # define DIFFTEST_REG_SIZE (sizeof(uint32_t) * 38) // GPRs + status + lo + hi + badvaddr + cause + pc
 #elif defined(CONFIG_ISA_riscv)
 #define RISCV_GPR_TYPE MUXDEF(CONFIG_RV64, uint64_t, uint32_t)
 #define RISCV_GPR_NUM  MUXDEF(CONFIG_RVE , 16, 32)
+#define DIFFTEST_REG_T RISCV_GPR_TYPE
 #define DIFFTEST_REG_SIZE (sizeof(RISCV_GPR_TYPE) * (RISCV_GPR_NUM + 1)) // GPRs + pc
 #elif defined(CONFIG_ISA_loongarch32r)
+# define DIFFTEST_REG_T uint32_t
 # define DIFFTEST_REG_SIZE (sizeof(uint32_t) * 33) // GPRs + pc
 #else
 # error Unsupport ISA
 #endif
 
+// the register image is an array of DIFFTEST_REG_T, with pc at the end
+#define DIFFTEST_NR_REG (DIFFTEST_REG_SIZE / sizeof(DIFFTEST_REG_T))
+#define DIFFTEST_PC_IDX (DIFFTEST_NR_REG - 1)
+
+/* Used by `difftest_exec_and_regcpy(n, buf, dirty_mask)' in REF.
+ * Compare the register image `now' with `last', the one reported to DUT
+ * last time. Pack the changed registers and pc into `buf' in ascending
+ * order, update `last', and return the mask of the packed registers. */
+static inline uint64_t difftest_pack_regs(const DIFFTEST_REG_T *now, DIFFTEST_REG_T *last, DIFFTEST_REG_T *buf) {
+  uint64_t mask = 0;
+  for (int i = 0; i < (int)DIFFTEST_NR_REG; i ++) {
+    if (now[i] != last[i] || i == (int)DIFFTEST_PC_IDX) {
+      *buf ++ = last[i] = now[i];
+      mask |= 1ull << i;
+    }
+  }
+  return mask;
+}
+
+/* Used by DUT to apply the result of `difftest_exec_and_regcpy()' to its
+ * copy of the REF register image. */
+static inline void difftest_unpack_regs(DIFFTEST_REG_T *regs, const DIFFTEST_REG_T *buf, uint64_t mask) {
+  for (int i = 0; mask != 0; i ++, mask >>= 1) {
+    if (mask & 1) regs[i] = *buf ++;
+  }
+}
+
+/* An entry of the store log returned by `difftest_storelog()' of REF,
+ * the bytes of `data' beyond `len' are cleared. */
+typedef struct {
+  uint64_t addr;
+  uint64_t data;
+  uint32_t len;
+} difftest_store_t;
+
+static inline difftest_store_t difftest_store_entry(uint64_t addr, int len, uint64_t data) {
+  difftest_store_t e = { .addr = addr, .data = (len >= 8 ? data : data & ((1ull << (len * 8)) - 1)), .len = (uint32_t)len };
+  return e;
+}
+
+#define DIFFTEST_PAGE_SIZE 4096
+
+/* Hash of a memory page used by `difftest_memhash()'. Both DUT and REF
+ * should use this function to get the same result. The words are mixed
+ * in four independent lanes so that the loop can be vectorized. */
+static inline uint64_t difftest_page_hash(const void *page) {
+  const uint64_t *p = (const uint64_t *)page;
+  uint64_t h[4] = { 1, 2, 3, 4 };
+  for (int i = 0; i < DIFFTEST_PAGE_SIZE / 8; i += 4) {
+    for (int j = 0; j < 4; j ++) {
+      h[j] = (h[j] ^ p[i + j]) * 0x9e3779b97f4a7c15ull;
+    }
+  }
+  return h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16);
+}
+
 #endif
@@ -34,4 +34,52 @@ static inline bool in_pmem(paddr_t addr) {
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+// the operations of atomic memory accesses
+enum { AMO_SWAP, AMO_ADD, AMO_AND, AMO_OR, AMO_XOR, AMO_MIN, AMO_MAX, AMO_MINU, AMO_MAXU };
+
+static inline word_t amo_result(int op, word_t old, word_t data, int len) {
+  // signed comparison of `len' bytes
+  int64_t s_old = (len == 4 ? (int32_t)old : (int64_t)old);
+  int64_t s_data = (len == 4 ? (int32_t)data : (int64_t)data);
+  switch (op) {
+    case AMO_SWAP: return data;
+    case AMO_ADD:  return old + data;
+    case AMO_AND:  return old & data;
+    case AMO_OR:   return old | data;
+    case AMO_XOR:  return old ^ data;
+    case AMO_MIN:  return (s_old < s_data ? old : data);
+    case AMO_MAX:  return (s_old > s_data ? old : data);
+    case AMO_MINU: return (old < data ? old : data);
+    case AMO_MAXU: return (old > data ? old : data);
+    default: panic("Unknown atomic operation %d", op);
+  }
+}
+
+#ifdef CONFIG_SMP
+/* Atomically replace the data at `addr' with amo_result(op, old, data),
+ * and return the old data. */
+word_t paddr_amo(paddr_t addr, int len, int op, word_t data);
+/* Reserve the granule of `addr' for lr.w of the current hart. */
+void paddr_reserve(paddr_t addr);
+/* Atomically replace the data at `addr' with `data' if the reservation of
+ * the current hart is still on the granule of `addr' and the data is `old'.
+ * Drop the reservation, and return whether the data is replaced. */
+bool paddr_sc(paddr_t addr, int len, word_t old, word_t data);
+#endif
+
+#ifdef CONFIG_PMEM_DIRTY
+#define PMEM_PAGE_SHIFT 12
+#define PMEM_PAGE_SIZE (1u << PMEM_PAGE_SHIFT)
+
+// consumers of the dirty bits
+enum { PMEM_DIRTY_MEMHASH = 0x1, PMEM_DIRTY_CKPT = 0x2, PMEM_DIRTY_ATTACH = 0x4 };
+
+/* Collect at most `max' pages which are dirty for `consumer' into `pages',
+ * and clear their dirty bits. Return the number of pages collected. */
+int pmem_dirty_scan(uint8_t consumer, paddr_t *pages, int max);
+
+/* Mark the pages written without paddr_write() as dirty. */
+void pmem_dirty_range(paddr_t addr, size_t len);
+#endif
+
 #endif
@@ -28,11 +28,19 @@ typedef struct {
   uint32_t halt_ret;
 } NEMUState;
 
-extern NEMUState nemu_state;
+extern MACHINE_LOCAL NEMUState nemu_state;
 
 // ----------- timer -----------
 
 uint64_t get_time();
+void set_time(uint64_t us);
+uint64_t get_host_time();
+
+// ----------- checkpoint -----------
+
+/* Save `size' bytes of internal state at `ptr' in checkpoints. They are matched
+ * by `name' on restore, after which `restore' is called if it is not NULL. */
+void checkpoint_add_state(const char *name, void *ptr, size_t size, void (*restore)());
 
 // ----------- log -----------
 
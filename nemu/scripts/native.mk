@@ -41,10 +41,27 @@ gdb: run-env
 	$(call git_commit, "gdb NEMU")
 	gdb -s $(BINARY) --args $(NEMU_EXEC)
 
+# Fuzz NEMU with random programs from tools/gen-inst, which are checked by
+# DiffTest if it is enabled, e.g. `make fuzz -j8 FUZZ_NR=10000 FUZZ_FLAGS=-m'
+FUZZ_NR ?= 1000
+FUZZ_LEN ?= 1000
+FUZZ_SEED ?= 1
+FUZZ_FLAGS ?=
+FUZZ_DIR = $(BUILD_DIR)/fuzz
+
+fuzz: run-env
+	$(if $(filter riscv32,$(GUEST_ISA)),,$(error tools/gen-inst only supports riscv32))
+	$(if $(CONFIG_DIFFTEST),,$(warning DiffTest is disabled, only the trap of each program is checked))
+	$(call git_commit, "fuzz NEMU")
+	@$(MAKE) -s -C $(NEMU_HOME)/tools/gen-inst
+	@rm -rf $(FUZZ_DIR) && mkdir -p $(FUZZ_DIR)
+	@$(MAKE) -s -f $(NEMU_HOME)/tools/gen-inst/fuzz.mk NEMU="$(BINARY) $(ARGS_DIFF)" \
+	  FUZZ_DIR=$(FUZZ_DIR) FUZZ_NR=$(FUZZ_NR) FUZZ_LEN=$(FUZZ_LEN) FUZZ_SEED=$(FUZZ_SEED) FUZZ_FLAGS=$(FUZZ_FLAGS)
+
 clean-tools = $(dir $(shell find ./tools -maxdepth 2 -mindepth 2 -name "Makefile"))
 $(clean-tools):
 	-@$(MAKE) -s -C $@ clean
 clean-tools: $(clean-tools)
 clean-all: clean distclean clean-tools
 
-.PHONY: run gdb run-env clean-tools clean-all $(clean-tools)
+.PHONY: run gdb run-env fuzz clean-tools clean-all $(clean-tools)
@@ -16,6 +16,7 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/event.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -25,12 +26,29 @@
  */
 #define MAX_INST_TO_PRINT 10
 
-CPU_state cpu = {};
-uint64_t g_nr_guest_inst = 0;
-static uint64_t g_timer = 0; // unit: us
-static bool g_print_step = false;
-
-void device_update();
+HART_LOCAL CPU_state cpu = {};
+HART_LOCAL int g_hart_id = 0;
+MACHINE_LOCAL uint64_t g_nr_guest_inst = 0;
+static MACHINE_LOCAL uint64_t g_timer = 0; // unit: us
+static MACHINE_LOCAL bool g_print_step = false;
+
+void checkpoint_periodic();
+extern uint64_t g_ckpt_next_inst;
+void snapshot_periodic();
+extern uint64_t g_snap_next_inst;
+void bbv_step(vaddr_t snpc, vaddr_t dnpc);
+extern bool g_bbv_on;
+void idle_backward_jump(vaddr_t target);
+void gdbstub_check_stop(vaddr_t pc);
+void smp_resume();
+void smp_pause();
+uint64_t smp_nr_inst();
+void trace_flush();
+void replay_flush();
+#ifdef CONFIG_BATCH_RUN
+void batch_run_recover();
+extern __thread bool g_batch_worker;
+#endif
 
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #ifdef CONFIG_ITRACE_COND
@@ -38,6 +56,7 @@ static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #endif
   if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+  IFDEF(CONFIG_GDBSTUB, gdbstub_check_stop(dnpc));
 }
 
 static void exec_once(Decode *s, vaddr_t pc) {
@@ -78,20 +97,49 @@ static void execute(uint64_t n) {
     g_nr_guest_inst ++;
     trace_and_difftest(&s, cpu.pc);
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    IFDEF(CONFIG_CHECKPOINT, if (unlikely(g_nr_guest_inst >= g_ckpt_next_inst)) checkpoint_periodic());
+    IFDEF(CONFIG_SNAPSHOT, if (unlikely(g_nr_guest_inst >= g_snap_next_inst)) snapshot_periodic());
+    IFDEF(CONFIG_BBV, if (unlikely(g_bbv_on)) bbv_step(s.snpc, cpu.pc));
+    IFDEF(CONFIG_IDLE_SKIP, if (unlikely(cpu.pc <= s.pc)) idle_backward_jump(cpu.pc));
+    if (unlikely(g_nr_guest_inst >= g_event_next_inst)) event_run();
+  }
+}
+
+// the trigger to stop fast-forwarding, see cpu_fast_forward()
+static bool g_fast_forward = false;
+static uint64_t ff_nr_inst = 0;
+static bool ff_by_pc = false;
+static vaddr_t ff_pc = 0;
+
+/* Only execute the instructions, without any tracing, checking or profiling. */
+static void execute_fast(uint64_t n) {
+  Decode s;
+  for (; n > 0 && g_nr_guest_inst < ff_nr_inst && !(ff_by_pc && cpu.pc == ff_pc); n --) {
+    s.pc = s.snpc = cpu.pc;
+    isa_exec_once(&s);
+    cpu.pc = s.dnpc;
+    g_nr_guest_inst ++;
+    if (nemu_state.state != NEMU_RUNNING) break;
+    IFDEF(CONFIG_IDLE_SKIP, if (unlikely(cpu.pc <= s.pc)) idle_backward_jump(cpu.pc));
+    if (unlikely(g_nr_guest_inst >= g_event_next_inst)) event_run();
   }
 }
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
 #define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
+  // `g_nr_guest_inst' only counts hart 0, which drives the events
+  uint64_t nr_inst = g_nr_guest_inst + MUXDEF(CONFIG_SMP, smp_nr_inst(), 0);
   Log("host time spent = " NUMBERIC_FMT " us", g_timer);
-  Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
-  if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
+  Log("total guest instructions = " NUMBERIC_FMT, nr_inst);
+  if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", nr_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
 }
 
 void assert_fail_msg() {
+  IFDEF(CONFIG_BATCH_RUN, batch_run_recover());
+  IFDEF(CONFIG_DIFFTEST_TRACE, trace_flush());
+  IFDEF(CONFIG_DEVICE_REPLAY, replay_flush());
   isa_reg_display();
   statistic();
 }
@@ -100,19 +148,26 @@ void assert_fail_msg() {
 void cpu_exec(uint64_t n) {
   g_print_step = (n < MAX_INST_TO_PRINT);
   switch (nemu_state.state) {
-    case NEMU_END: case NEMU_ABORT:
+    case NEMU_END: case NEMU_ABORT: case NEMU_QUIT:
       printf("Program execution has ended. To restart the program, exit NEMU and run again.\n");
       return;
     default: nemu_state.state = NEMU_RUNNING;
   }
 
-  uint64_t timer_start = get_time();
+  uint64_t timer_start = get_host_time();
 
-  execute(n);
+  IFDEF(CONFIG_SMP, smp_resume());
+  if (g_fast_forward) execute_fast(n);
+  else execute(n);
+  IFDEF(CONFIG_SMP, smp_pause());
+  difftest_flush();
 
-  uint64_t timer_end = get_time();
+  uint64_t timer_end = get_host_time();
   g_timer += timer_end - timer_start;
 
+  // the runner reports the result of each image instead
+  IFDEF(CONFIG_BATCH_RUN, if (g_batch_worker) return);
+
   switch (nemu_state.state) {
     case NEMU_RUNNING: nemu_state.state = NEMU_STOP; break;
 
@@ -126,3 +181,18 @@ void cpu_exec(uint64_t n) {
     case NEMU_QUIT: statistic();
   }
 }
+
+/* Run at full speed until `g_nr_guest_inst' reaches `nr_inst', or until the
+ * pc reaches `pc' if `by_pc', then bring REF in sync with DUT, so that tracing,
+ * checking and profiling start from there. */
+void cpu_fast_forward(uint64_t nr_inst, bool by_pc, vaddr_t pc) {
+  ff_nr_inst = nr_inst;
+  ff_by_pc = by_pc;
+  ff_pc = pc;
+  difftest_detach();
+  g_fast_forward = true;
+  cpu_exec(-1);
+  g_fast_forward = false;
+  difftest_attach();
+  Log("Fast-forwarded to instruction %" PRIu64 ", pc = " FMT_WORD, g_nr_guest_inst, cpu.pc);
+}
@@ -13,11 +13,13 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE
 #include <dlfcn.h>
 
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/host.h>
 #include <utils.h>
 #include <difftest-def.h>
 
@@ -25,15 +27,506 @@ void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) =
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
 void (*ref_difftest_exec)(uint64_t n) = NULL;
 void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
+void (*ref_difftest_memhash)(const paddr_t *addr, int nr, uint64_t *hash) = NULL;
+void (*ref_difftest_exec_and_regcpy)(uint64_t n, void *buf, uint64_t *dirty_mask) = NULL;
+void (*ref_difftest_exec_to)(uint64_t pc, uint64_t nr_hit) = NULL;
+int (*ref_difftest_storelog)(difftest_store_t *buf, int max) = NULL;
 
 #ifdef CONFIG_DIFFTEST
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
+static bool is_detached = false; // DUT runs alone until difftest_attach()
+
+// the register image of REF, updated with the registers
+// reported dirty by difftest_exec_and_regcpy()
+static DIFFTEST_REG_T ref_regs[DIFFTEST_NR_REG] = {};
+
+// let REF execute `n' instructions, and fetch its register image
+static void ref_exec_regcpy(uint64_t n, CPU_state *ref_r) {
+  if (ref_difftest_exec_and_regcpy != NULL) {
+    DIFFTEST_REG_T buf[DIFFTEST_NR_REG];
+    uint64_t dirty_mask;
+    ref_difftest_exec_and_regcpy(n, buf, &dirty_mask);
+    difftest_unpack_regs(ref_regs, buf, dirty_mask);
+    memcpy(ref_r, ref_regs, DIFFTEST_REG_SIZE);
+  } else {
+    ref_difftest_exec(n);
+    ref_difftest_regcpy(ref_r, DIFFTEST_TO_DUT);
+  }
+}
+
+#ifdef CONFIG_DIFFTEST_STORESTREAM
+#define NR_STORELOG 4096
+
+static difftest_store_t dut_store[NR_STORELOG];
+static vaddr_t dut_store_pc[NR_STORELOG];
+static int dut_store_nr = 0;
+static bool dut_store_lost = false;
+
+void difftest_log_vstore(vaddr_t addr, int len, word_t data) {
+  if (dut_store_nr == NR_STORELOG) { dut_store_lost = true; return; }
+  dut_store_pc[dut_store_nr] = cpu.pc;
+  dut_store[dut_store_nr ++] = difftest_store_entry(addr, len, data);
+}
+
+// forget the stores since the last checking point on both sides
+static void storelog_reset() {
+  dut_store_nr = 0;
+  dut_store_lost = false;
+  if (ref_difftest_storelog == NULL) return;
+  difftest_store_t buf[256];
+  while (ref_difftest_storelog(buf, ARRLEN(buf)) > 0);
+}
+
+static void log_store(const char *who, difftest_store_t *e) {
+  Log("%s: %d bytes of 0x%" PRIx64 " to 0x%" PRIx64, who, e->len, e->data, e->addr);
+}
+
+// the stores of REF taken by the last storelog_check(), -1 if they are lost
+static difftest_store_t ref_store[NR_STORELOG];
+static int ref_store_nr = -1;
+
+// compare the stores since the last checking point in order,
+// return the pc of the first different store, or 0 if they are the same
+static vaddr_t storelog_check(vaddr_t pc) {
+  ref_store_nr = -1;
+  if (ref_difftest_storelog == NULL) return 0;
+  int nr = ref_store_nr = ref_difftest_storelog(ref_store, NR_STORELOG);
+  if (nr < 0 || dut_store_lost) {
+    // too many stores since the last checking point
+    storelog_reset();
+    return 0;
+  }
+
+  int i;
+  for (i = 0; i < nr && i < dut_store_nr; i ++) {
+    difftest_store_t *r = &ref_store[i], *d = &dut_store[i];
+    if (r->addr != d->addr || r->len != d->len || r->data != d->data) break;
+  }
+  int dut_nr = dut_store_nr;
+  dut_store_nr = 0;
+  if (i == nr && i == dut_nr) return 0;
+
+  vaddr_t fail_pc = (i < dut_nr ? dut_store_pc[i] : pc);
+  Log("store %d since the last checking point is different, at pc = " FMT_WORD, i, fail_pc);
+  if (i < nr) log_store("right", &ref_store[i]);
+  else Log("right: no more stores");
+  if (i < dut_nr) log_store("wrong", &dut_store[i]);
+  else Log("wrong: no more stores");
+  return fail_pc;
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_BATCH
+#define BATCH_SIZE CONFIG_DIFFTEST_BATCH_SIZE
+#define NR_UNDO (BATCH_SIZE * 4)
+#ifdef CONFIG_DIFFTEST_BATCH_BLOCK
+// a batch may grow beyond BATCH_SIZE while waiting for a control transfer
+#define NR_BATCH_SNAP (BATCH_SIZE * 2)
+#define MAX_ILEN MUXDEF(CONFIG_ISA_x86, 15, 4)
+#else
+#define NR_BATCH_SNAP BATCH_SIZE
+#endif
+
+// old content of pmem before a store, used to roll back REF and DUT
+typedef struct {
+  int idx; // index in the batch of the instruction performing the store
+  int len;
+  paddr_t addr;
+  word_t old;
+} UndoEntry;
+
+static CPU_state batch_ckpt;             // state of both DUT and REF at the beginning of the batch
+static CPU_state batch_snap[NR_BATCH_SNAP]; // state of DUT after each instruction in the batch
+static vaddr_t batch_pc[NR_BATCH_SNAP];
+static int batch_nr = 0;
+static UndoEntry undo[NR_UNDO];
+static int undo_nr = 0;
+static bool undo_overflow = false;
+static int batch_fail_idx = -1;
+
+static void batch_reset(CPU_state *ckpt) {
+  batch_ckpt = *ckpt;
+  batch_nr = 0;
+  undo_nr = 0;
+  undo_overflow = false;
+}
+
+void difftest_log_store(paddr_t addr, int len) {
+  if (undo_nr == NR_UNDO) { undo_overflow = true; return; }
+  undo[undo_nr ++] = (UndoEntry) {
+    .idx = batch_nr, .len = len, .addr = addr, .old = host_read(guest_to_host(addr), len) };
+}
+
+static bool regs_match(CPU_state *ref, CPU_state *dut) {
+  return memcmp(ref, dut, DIFFTEST_REG_SIZE) == 0;
+}
+
+// Bring REF back to the state after the `idx`-th instruction of the batch,
+// where -1 stands for the beginning of the batch. Only the register image
+// and pmem are restored, other architectural states inside REF are not.
+static void ref_rollback(int idx) {
+  for (int i = undo_nr - 1; i >= 0 && undo[i].idx > idx; i --) {
+    ref_difftest_memcpy(undo[i].addr, &undo[i].old, undo[i].len, DIFFTEST_TO_REF);
+  }
+  ref_difftest_regcpy(idx < 0 ? &batch_ckpt : &batch_snap[idx], DIFFTEST_TO_REF);
+}
+
+static void dut_rollback(int idx) {
+  for (int i = undo_nr - 1; i >= 0 && undo[i].idx > idx; i --) {
+    host_write(guest_to_host(undo[i].addr), undo[i].len, undo[i].old);
+  }
+  cpu = batch_snap[idx];
+}
+
+// REF is after the last instruction of the batch and mismatches,
+// find the first instruction making REF and DUT diverge
+static int batch_bisect(CPU_state *ref_r) {
+  int lo = -1, hi = batch_nr - 1;
+  ref_rollback(lo);
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    ref_exec_regcpy(mid - lo, ref_r);
+    if (regs_match(ref_r, &batch_snap[mid])) lo = mid;
+    else { hi = mid; ref_rollback(lo); }
+  }
+  ref_exec_regcpy(hi - lo, ref_r);
+  return hi;
+}
+
+// let REF run the whole batch, with a breakpoint at the pc after the batch
+// if REF supports it, which is much faster than stepping for KVM
+static void ref_exec_batch(CPU_state *ref_r) {
+  if (ref_difftest_exec_to == NULL) {
+    ref_exec_regcpy(batch_nr, ref_r);
+    return;
+  }
+  // count how many times REF should arrive at the pc, the starting one is not counted
+  vaddr_t target = batch_snap[batch_nr - 1].pc;
+  uint64_t nr_hit = 1;
+  for (int i = 1; i < batch_nr; i ++) {
+    nr_hit += (batch_pc[i] == target);
+  }
+  ref_difftest_exec_to(target, nr_hit);
+  ref_exec_regcpy(0, ref_r);
+}
+
+static bool batch_should_end(vaddr_t pc, vaddr_t npc) {
+  if (batch_nr == NR_BATCH_SNAP || undo_nr > NR_UNDO / 2) return true;
+  if (batch_nr < BATCH_SIZE) return false;
+#ifdef CONFIG_DIFFTEST_BATCH_BLOCK
+  // end the batch at a control transfer, including traps
+  return npc <= pc || npc > pc + MAX_ILEN;
+#else
+  return true;
+#endif
+}
+
+// let REF catch up with the instructions in the batch and check the result,
+// this may be called in the middle of an instruction which is not in the batch
+static void batch_check() {
+  if (batch_nr == 0 || batch_fail_idx >= 0) return;
+
+  CPU_state ref_r;
+  ref_exec_batch(&ref_r);
+  if (likely(regs_match(&ref_r, &batch_snap[batch_nr - 1]))) {
+#ifdef CONFIG_DIFFTEST_STORESTREAM
+    vaddr_t fail_pc = storelog_check(batch_pc[batch_nr - 1]);
+    if (fail_pc != 0) {
+      batch_nr = 0; // DUT is not rolled back
+      nemu_state.state = NEMU_ABORT;
+      nemu_state.halt_pc = fail_pc;
+      return;
+    }
+#endif
+    batch_reset(&batch_snap[batch_nr - 1]);
+    return;
+  }
+
+  if (undo_overflow) {
+    Log("too many stores in the batch, can not locate the divergent instruction");
+    batch_fail_idx = batch_nr - 1;
+  } else {
+    batch_fail_idx = batch_bisect(&ref_r);
+  }
+  Log("REF diverges at instruction %d of the batch starting at pc = " FMT_WORD,
+      batch_fail_idx, batch_pc[0]);
+
+  // DUT is rolled back in difftest_flush(), since we may be in the middle of an instruction
+  CPU_state dut_r = cpu;
+  cpu = batch_snap[batch_fail_idx];
+  bool ok = isa_difftest_checkregs(&ref_r, batch_pc[batch_fail_idx]);
+  cpu = dut_r;
+  if (ok) Log("the register images of REF and DUT are different");
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = batch_pc[batch_fail_idx];
+}
+
+#endif
+
+#ifdef CONFIG_DIFFTEST_PIPELINE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+
+/* DUT pushes a commit record for each instruction into a single-producer
+ * single-consumer queue, and a second thread drives REF and checks the
+ * records. A record takes a variable number of 64-bit slots:
+ *   pc, mask of the changed registers, number of stores,
+ *   the changed registers, (address | len << 32, data) of each store
+ */
+#define NR_SLOT (1 << 16)
+#define PIPE_MAX_STORE 4
+#define NR_CONTEXT 16
+#define SLOT(i) q_slot[(i) & (NR_SLOT - 1)]
+
+static uint64_t q_slot[NR_SLOT];
+static _Atomic uint64_t q_head = 0; // advanced by the REF thread after checking a record
+static _Atomic uint64_t q_tail = 0; // advanced by DUT after pushing a record
+static atomic_bool pipe_error = false;
+
+// owned by DUT
+static DIFFTEST_REG_T pipe_last[DIFFTEST_NR_REG]; // register image of the last record
+static struct { paddr_t addr; int len; } pipe_store[PIPE_MAX_STORE];
+static int pipe_store_nr = 0;
+static uint64_t pipe_nr_push = 0;
+static bool pipe_reported = false;
+
+// owned by the REF thread, or by DUT when the queue is drained
+static DIFFTEST_REG_T pipe_dut[DIFFTEST_NR_REG]; // register image of DUT rebuilt from the records
+static vaddr_t pipe_ctx[NR_CONTEXT];
+static uint64_t pipe_nr_done = 0;
+static CPU_state pipe_err_ref;
+static paddr_t pipe_err_addr = 0;
+
+// spin for a while before giving up the core, which matters on a single-core host
+static inline void pipe_wait(int *spin) {
+  if (++ *spin > 64) sched_yield();
+}
+
+void difftest_log_store(paddr_t addr, int len) {
+  if (pipe_store_nr < PIPE_MAX_STORE) {
+    pipe_store[pipe_store_nr ++] = (typeof(pipe_store[0])) { .addr = addr, .len = len };
+  }
+}
+
+// should be called when the REF thread is idle
+static void pipe_reset(CPU_state *dut) {
+  memcpy(pipe_last, dut, DIFFTEST_REG_SIZE);
+  memcpy(pipe_dut, dut, DIFFTEST_REG_SIZE);
+  pipe_store_nr = 0;
+}
+
+static void pipe_push(vaddr_t pc) {
+  DIFFTEST_REG_T buf[DIFFTEST_NR_REG];
+  uint64_t mask = difftest_pack_regs((DIFFTEST_REG_T *)&cpu, pipe_last, buf);
+  int nr_reg = __builtin_popcountll(mask);
+  uint64_t t = atomic_load_explicit(&q_tail, memory_order_relaxed);
+  uint64_t size = 3 + nr_reg + pipe_store_nr * 2;
+  int spin = 0;
+  while (t + size - atomic_load_explicit(&q_head, memory_order_acquire) > NR_SLOT) {
+    if (atomic_load_explicit(&pipe_error, memory_order_relaxed)) return;
+    pipe_wait(&spin);
+  }
+
+  SLOT(t) = pc;
+  SLOT(t + 1) = mask;
+  SLOT(t + 2) = pipe_store_nr;
+  int k = 3;
+  for (int i = 0; i < nr_reg; i ++) SLOT(t + k ++) = buf[i];
+  for (int i = 0; i < pipe_store_nr; i ++) {
+    SLOT(t + k ++) = pipe_store[i].addr | ((uint64_t)pipe_store[i].len << 32);
+    SLOT(t + k ++) = host_read(guest_to_host(pipe_store[i].addr), pipe_store[i].len);
+  }
+  pipe_store_nr = 0;
+  pipe_nr_push ++;
+  atomic_store_explicit(&q_tail, t + size, memory_order_release);
+}
+
+// check the record at slot `h', return its size or 0 on a mismatch
+static int pipe_check(uint64_t h) {
+  vaddr_t pc = SLOT(h);
+  uint64_t mask = SLOT(h + 1);
+  int nr_store = SLOT(h + 2);
+  int nr_reg = __builtin_popcountll(mask);
+  DIFFTEST_REG_T buf[DIFFTEST_NR_REG];
+  int k = 3;
+  for (int i = 0; i < nr_reg; i ++) buf[i] = SLOT(h + k ++);
+  difftest_unpack_regs(pipe_dut, buf, mask);
+  pipe_ctx[pipe_nr_done % NR_CONTEXT] = pc;
+
+  ref_exec_regcpy(1, &pipe_err_ref);
+  bool ok = memcmp(&pipe_err_ref, pipe_dut, DIFFTEST_REG_SIZE) == 0;
+  for (int i = 0; i < nr_store; i ++, k += 2) {
+    paddr_t addr = (paddr_t)SLOT(h + k);
+    int len = SLOT(h + k) >> 32;
+    uint64_t dut_data = SLOT(h + k + 1), ref_data = 0;
+    ref_difftest_memcpy(addr, &ref_data, len, DIFFTEST_TO_DUT);
+    if (memcmp(&ref_data, &dut_data, len) != 0) { ok = false; pipe_err_addr = addr; }
+  }
+  if (!ok) return 0;
+  pipe_nr_done ++;
+  return k;
+}
+
+static void* pipe_ref_thread(void *arg) {
+  uint64_t h = atomic_load(&q_head);
+  int idle = 0;
+  while (true) {
+    if (h == atomic_load_explicit(&q_tail, memory_order_acquire)) {
+      // do not burn the core when DUT is waiting in sdb
+      if (idle > 100000) usleep(100);
+      else pipe_wait(&idle);
+      continue;
+    }
+    idle = 0;
+    int size = pipe_check(h);
+    if (size == 0) break;
+    h += size;
+    atomic_store_explicit(&q_head, h, memory_order_release);
+  }
+  atomic_store(&pipe_error, true);
+  return NULL;
+}
+
+static void pipe_report() {
+  if (pipe_reported) return;
+  pipe_reported = true;
+  vaddr_t pc = pipe_ctx[pipe_nr_done % NR_CONTEXT];
+  Log("REF diverges at pc = " FMT_WORD ", while DUT is %" PRIu64 " instructions ahead",
+      pc, pipe_nr_push - pipe_nr_done - 1);
+  Log("the last instructions checked by REF:");
+  for (int i = (pipe_nr_done >= NR_CONTEXT - 1 ? NR_CONTEXT - 1 : pipe_nr_done); i >= 0; i --) {
+    Log("  " FMT_WORD, pipe_ctx[(pipe_nr_done - i) % NR_CONTEXT]);
+  }
+  if (pipe_err_addr != 0) Log("the data stored to " FMT_PADDR " is different", pipe_err_addr);
+
+  // show the registers at the divergent instruction, note that pmem is not rolled back
+  memcpy(&cpu, pipe_dut, DIFFTEST_REG_SIZE);
+  if (isa_difftest_checkregs(&pipe_err_ref, pc) && pipe_err_addr == 0) {
+    Log("the register images of REF and DUT are different");
+  }
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  isa_reg_display();
+}
+
+// wait for the REF thread to check all records, after that DUT can access REF
+static void pipe_drain() {
+  uint64_t t = atomic_load_explicit(&q_tail, memory_order_relaxed);
+  int spin = 0;
+  while (atomic_load_explicit(&q_head, memory_order_acquire) != t) {
+    if (atomic_load(&pipe_error)) { pipe_report(); return; }
+    pipe_wait(&spin);
+  }
+}
+
+static void pipe_start(CPU_state *dut) {
+  pipe_reset(dut);
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, pipe_ref_thread, NULL);
+  Assert(ret == 0, "can not create the REF thread");
+  pthread_detach(thread);
+}
+
+// the REF thread exits on a mismatch, start it again after REF is in sync
+static void pipe_restart(CPU_state *dut) {
+  if (!atomic_load(&pipe_error)) { pipe_reset(dut); return; }
+  atomic_store(&q_head, atomic_load(&q_tail));
+  pipe_nr_done = pipe_nr_push;
+  pipe_err_addr = 0;
+  pipe_reported = false;
+  atomic_store(&pipe_error, false);
+  pipe_start(dut);
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_TRACE
+bool trace_init(long img_size);
+bool trace_recording();
+bool trace_replaying();
+bool trace_replay_step(vaddr_t pc);
+void trace_record(CPU_state *ref_r);
+
+// move at most `max' stores of REF by the last instruction to `buf', return the number of them
+int difftest_ref_stores(difftest_store_t *buf, int max) {
+#ifdef CONFIG_DIFFTEST_STORESTREAM
+  // they are already taken from REF and checked by storelog_check()
+  if (ref_store_nr < 0) return -1;
+  int nr = (ref_store_nr < max ? ref_store_nr : max);
+  memcpy(buf, ref_store, sizeof(buf[0]) * nr);
+  ref_store_nr = 0;
+  return nr;
+#else
+  return ref_difftest_storelog(buf, max);
+#endif
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_MEMHASH
+#define MEMHASH_CHUNK 256
+static_assert(PMEM_PAGE_SIZE == DIFFTEST_PAGE_SIZE, "page size of the dirty map should match difftest");
+
+static uint64_t memhash_last_inst = 0;
+
+// compare the pages written since the last check, REF should be in sync with DUT
+static void memhash_check(vaddr_t pc) {
+  if (ref_difftest_memhash == NULL) return;
+#ifdef CONFIG_DIFFTEST_PIPELINE
+  pipe_drain();
+  if (nemu_state.state == NEMU_ABORT) return;
+#endif
+
+  paddr_t pages[MEMHASH_CHUNK];
+  uint64_t ref_hash[MEMHASH_CHUNK];
+  int nr;
+  while ((nr = pmem_dirty_scan(PMEM_DIRTY_MEMHASH, pages, MEMHASH_CHUNK)) > 0) {
+    ref_difftest_memhash(pages, nr, ref_hash);
+    for (int i = 0; i < nr; i ++) {
+      if (difftest_page_hash(guest_to_host(pages[i])) != ref_hash[i]) {
+        Log("memory page at " FMT_PADDR " is different within %" PRIu64
+            " instructions before pc = " FMT_WORD,
+            pages[i], g_nr_guest_inst - memhash_last_inst, pc);
+        nemu_state.state = NEMU_ABORT;
+        nemu_state.halt_pc = pc;
+        isa_reg_display();
+        return;
+      }
+    }
+  }
+  memhash_last_inst = g_nr_guest_inst;
+}
+
+static void memhash_step(vaddr_t pc) {
+  if (nemu_state.state == NEMU_RUNNING &&
+      g_nr_guest_inst - memhash_last_inst >= CONFIG_DIFFTEST_MEMHASH_INTERVAL) {
+    memhash_check(pc);
+  }
+}
+#endif
+
+void difftest_flush() {
+  if (is_detached || skip_dut_nr_inst > 0) return;
+#ifdef CONFIG_DIFFTEST_BATCH
+  batch_check();
+  if (batch_fail_idx >= 0) {
+    dut_rollback(batch_fail_idx);
+    isa_reg_display();
+    return;
+  }
+#endif
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_drain());
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, if (nemu_state.state != NEMU_ABORT) memhash_check(cpu.pc));
+}
 
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
+  if (is_detached) return;
+  IFDEF(CONFIG_DIFFTEST_BATCH, batch_check());
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_drain());
   is_skip_ref = true;
   // If such an instruction is one of the instruction packing in QEMU
   // (see below), we end the process of catching up with QEMU's pc to
@@ -52,6 +545,10 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  if (is_detached) return;
+  IFDEF(CONFIG_DIFFTEST_BATCH, batch_check());
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_drain());
+  IFDEF(CONFIG_DIFFTEST_TRACE, if (trace_replaying()) return);
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -59,12 +556,41 @@ void difftest_skip_dut(int nr_ref, int nr_dut) {
   }
 }
 
+#ifdef CONFIG_DIFFTEST_ATTACH_DIRTY
+// forget the pages written so far, REF has the same content of them
+static void attach_dirty_clear() {
+  paddr_t pages[256];
+  while (pmem_dirty_scan(PMEM_DIRTY_ATTACH, pages, ARRLEN(pages)) > 0);
+}
+
+static void attach_dirty_copy() {
+  paddr_t pages[256];
+  int nr, total = 0;
+  while ((nr = pmem_dirty_scan(PMEM_DIRTY_ATTACH, pages, ARRLEN(pages))) > 0) {
+    for (int i = 0; i < nr; i ++) {
+      ref_difftest_memcpy(pages[i], guest_to_host(pages[i]), PMEM_PAGE_SIZE, DIFFTEST_TO_REF);
+    }
+    total += nr;
+  }
+  Log("%d pages written while detached are copied to REF", total);
+}
+#endif
+
 void init_difftest(char *ref_so_file, long img_size, int port) {
+#ifdef CONFIG_DIFFTEST_TRACE
+  // the trace replaces REF
+  if (trace_init(img_size)) return;
+#endif
   assert(ref_so_file != NULL);
 
   void *handle;
+#ifdef CONFIG_DIFFTEST_REF_NEMU
+  // REF shares the symbol names with DUT, load it into a new namespace
+  handle = dlmopen(LM_ID_NEWLM, ref_so_file, RTLD_LAZY);
+#else
   handle = dlopen(ref_so_file, RTLD_LAZY);
-  assert(handle);
+#endif
+  if (handle == NULL) panic("%s", dlerror());
 
   ref_difftest_memcpy = dlsym(handle, "difftest_memcpy");
   assert(ref_difftest_memcpy);
@@ -78,6 +604,43 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   ref_difftest_raise_intr = dlsym(handle, "difftest_raise_intr");
   assert(ref_difftest_raise_intr);
 
+  int (*ref_difftest_version)() = dlsym(handle, "difftest_version");
+  int ref_version = (ref_difftest_version ? ref_difftest_version() : 0);
+  if (ref_version != DIFFTEST_ABI_VERSION) {
+    Log("ABI version of %s is %d, while DUT expects %d", ref_so_file, ref_version, DIFFTEST_ABI_VERSION);
+  }
+  if (ref_version >= 1) {
+    ref_difftest_exec_and_regcpy = dlsym(handle, "difftest_exec_and_regcpy");
+    assert(ref_difftest_exec_and_regcpy);
+  }
+
+  ref_difftest_exec_to = dlsym(handle, "difftest_exec_to");
+  IFDEF(CONFIG_DIFFTEST_BATCH, if (ref_difftest_exec_to) Log("%s runs batches to breakpoints", ref_so_file));
+
+  ref_difftest_storelog = dlsym(handle, "difftest_storelog");
+#ifdef CONFIG_DIFFTEST_STORESTREAM
+  if (ref_difftest_storelog == NULL) {
+    Log("%s does not provide difftest_storelog(), store comparison is disabled", ref_so_file);
+  }
+#endif
+
+#ifdef CONFIG_DIFFTEST_TRACE
+  if (trace_recording()) {
+    // the stores in the trace are the ones of REF
+    Assert(ref_difftest_storelog, "%s does not provide difftest_storelog(), "
+        "which is needed to record the trace", ref_so_file);
+    difftest_store_t buf[1];
+    ref_difftest_storelog(buf, 0); // start logging
+  }
+#endif
+
+  ref_difftest_memhash = dlsym(handle, "difftest_memhash");
+#ifdef CONFIG_DIFFTEST_MEMHASH
+  if (ref_difftest_memhash == NULL) {
+    Log("%s does not provide difftest_memhash(), memory comparison is disabled", ref_so_file);
+  }
+#endif
+
   void (*ref_difftest_init)(int) = dlsym(handle, "difftest_init");
   assert(ref_difftest_init);
 
@@ -85,10 +648,36 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   Log("The result of every instruction will be compared with %s. "
       "This will help you a lot for debugging, but also significantly reduce the performance. "
       "If it is not necessary, you can turn it off in menuconfig.", ref_so_file);
+  IFDEF(CONFIG_DIFFTEST_BATCH, Log("The results are checked in batches of %d instructions.", BATCH_SIZE));
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, Log("The results are checked on a separate thread."));
 
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  IFDEF(CONFIG_DIFFTEST_BATCH, batch_reset(&cpu));
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_start(&cpu));
+  IFDEF(CONFIG_DIFFTEST_STORESTREAM, storelog_reset());
+}
+
+// copy the whole machine state of DUT to REF, e.g. after DUT is restored
+// from a checkpoint or runs alone after difftest_detach(), and restart
+// checking from here
+void difftest_attach() {
+  if (ref_difftest_memcpy == NULL) { is_detached = false; return; }
+  // pmem of REF is only behind in the pages written since difftest_detach()
+  if (MUXDEF(CONFIG_DIFFTEST_ATTACH_DIRTY, is_detached, false)) {
+    IFDEF(CONFIG_DIFFTEST_ATTACH_DIRTY, attach_dirty_copy());
+  } else {
+    ref_difftest_memcpy(PMEM_LEFT, guest_to_host(PMEM_LEFT), CONFIG_MSIZE, DIFFTEST_TO_REF);
+    IFDEF(CONFIG_DIFFTEST_ATTACH_DIRTY, attach_dirty_clear());
+  }
+  is_detached = false;
+  isa_difftest_attach();
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  IFDEF(CONFIG_DIFFTEST_BATCH, batch_reset(&cpu); batch_fail_idx = -1);
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_restart(&cpu));
+  IFDEF(CONFIG_DIFFTEST_STORESTREAM, storelog_reset());
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
@@ -99,14 +688,29 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
   }
 }
 
+// stop checking, e.g. while fast-forwarding, until difftest_attach()
+void difftest_detach() {
+  if (is_detached) return;
+  difftest_flush();
+  is_detached = true;
+  IFDEF(CONFIG_DIFFTEST_ATTACH_DIRTY, attach_dirty_clear());
+}
+
 void difftest_step(vaddr_t pc, vaddr_t npc) {
   CPU_state ref_r;
 
+  if (is_detached) return;
+  IFDEF(CONFIG_DIFFTEST_TRACE, if (trace_replay_step(pc)) return);
+
   if (skip_dut_nr_inst > 0) {
+    IFDEF(CONFIG_DIFFTEST_TRACE, trace_record(NULL));
     ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
     if (ref_r.pc == npc) {
       skip_dut_nr_inst = 0;
       checkregs(&ref_r, npc);
+      IFDEF(CONFIG_DIFFTEST_BATCH, batch_reset(&cpu));
+      IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_reset(&cpu));
+      IFDEF(CONFIG_DIFFTEST_STORESTREAM, storelog_reset());
       return;
     }
     skip_dut_nr_inst --;
@@ -116,16 +720,43 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
   }
 
   if (is_skip_ref) {
+    // keep the failing batch for the rollback if it is checked by difftest_skip_ref()
+    IFDEF(CONFIG_DIFFTEST_BATCH, if (batch_fail_idx >= 0) return);
     // to skip the checking of an instruction, just copy the reg state to reference design
     ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
     is_skip_ref = false;
+    IFDEF(CONFIG_DIFFTEST_TRACE, trace_record(NULL));
+    IFDEF(CONFIG_DIFFTEST_BATCH, batch_reset(&cpu));
+    IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_reset(&cpu));
+    IFDEF(CONFIG_DIFFTEST_STORESTREAM, storelog_reset());
     return;
   }
 
-  ref_difftest_exec(1);
-  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
-
+#ifdef CONFIG_DIFFTEST_BATCH
+  if (batch_fail_idx >= 0) return;
+  batch_pc[batch_nr] = pc;
+  batch_snap[batch_nr] = cpu;
+  batch_nr ++;
+  if (batch_should_end(pc, npc)) batch_check();
+  if (batch_nr != 0) return;
+#elif defined(CONFIG_DIFFTEST_PIPELINE)
+  if (unlikely(atomic_load_explicit(&pipe_error, memory_order_relaxed))) {
+    pipe_report();
+    return;
+  }
+  pipe_push(pc);
+#else
+  ref_exec_regcpy(1, &ref_r);
   checkregs(&ref_r, pc);
+#ifdef CONFIG_DIFFTEST_STORESTREAM
+  if (nemu_state.state != NEMU_ABORT && storelog_check(pc) != 0) {
+    nemu_state.state = NEMU_ABORT;
+    nemu_state.halt_pc = pc;
+  }
+#endif
+  IFDEF(CONFIG_DIFFTEST_TRACE, trace_record(&ref_r));
+#endif
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, memhash_step(pc));
 }
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
@@ -19,19 +19,66 @@
 #include <memory/paddr.h>
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(0);
+  if (direction == DIFFTEST_TO_REF) memcpy(guest_to_host(addr), buf, n);
+  else memcpy(buf, guest_to_host(addr), n);
 }
 
+// only the register image defined by DIFFTEST_REG_SIZE is exchanged,
+// since DUT may be another version of NEMU with a different CPU_state
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
-  assert(0);
+  if (direction == DIFFTEST_TO_REF) memcpy(&cpu, dut, DIFFTEST_REG_SIZE);
+  else memcpy(dut, &cpu, DIFFTEST_REG_SIZE);
 }
 
 __EXPORT void difftest_exec(uint64_t n) {
-  assert(0);
+  cpu_exec(n);
+}
+
+__EXPORT void difftest_exec_and_regcpy(uint64_t n, void *buf, uint64_t *dirty_mask) {
+  static DIFFTEST_REG_T last[DIFFTEST_NR_REG] = {};
+  cpu_exec(n);
+  *dirty_mask = difftest_pack_regs((DIFFTEST_REG_T *)&cpu, last, buf);
+}
+
+__EXPORT int difftest_version() {
+  return DIFFTEST_ABI_VERSION;
 }
 
 __EXPORT void difftest_raise_intr(word_t NO) {
-  assert(0);
+  cpu.pc = isa_raise_intr(NO, cpu.pc);
+}
+
+__EXPORT void difftest_memhash(const paddr_t *addr, int nr, uint64_t *hash) {
+  for (int i = 0; i < nr; i ++) {
+    hash[i] = difftest_page_hash(guest_to_host(addr[i]));
+  }
+}
+
+#define NR_STORELOG 4096
+static difftest_store_t storelog[NR_STORELOG];
+static int storelog_nr = 0;
+static bool storelog_on = false, storelog_lost = false;
+
+// called by vaddr_write(), logging starts after DUT asks for the log
+void ref_log_store(vaddr_t addr, int len, word_t data) {
+  if (!storelog_on) return;
+  if (storelog_nr == NR_STORELOG) { storelog_lost = true; return; }
+  storelog[storelog_nr ++] = difftest_store_entry(addr, len, data);
+}
+
+// move at most `max' oldest stores to `buf', return -1 if some are lost
+__EXPORT int difftest_storelog(difftest_store_t *buf, int max) {
+  storelog_on = true;
+  if (storelog_lost) {
+    storelog_nr = 0;
+    storelog_lost = false;
+    return -1;
+  }
+  int nr = (storelog_nr < max ? storelog_nr : max);
+  memcpy(buf, storelog, sizeof(buf[0]) * nr);
+  memmove(storelog, storelog + nr, sizeof(buf[0]) * (storelog_nr - nr));
+  storelog_nr -= nr;
+  return nr;
 }
 
 __EXPORT void difftest_init(int port) {
@@ -0,0 +1,248 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/host.h>
+#include <difftest-def.h>
+
+#ifdef CONFIG_DIFFTEST_TRACE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The commit trace of REF is recorded once with `--diff-record', and later
+ * DUT runs can be checked against it with `--diff-replay' without REF.
+ * The file starts with a header, followed by one record per instruction:
+ *   uint64_t: mask of the changed registers | SKIP | number of stores << 56
+ *   DIFFTEST_REG_T[]: the changed registers
+ *   TraceStore[]: the stores
+ * The registers are the ones of REF, and so are the stores, which are taken
+ * from difftest_storelog() of REF.
+ * Instructions skipped by difftest are recorded with SKIP, and DUT adopts
+ * its own registers when replaying them.
+ */
+#define TRACE_MAGIC 0x45434152544d454eull // "NEMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_SKIP (1ull << 55)
+#define TRACE_NR_STORE_SHIFT 56
+#define TRACE_MAX_STORE 4
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reg_size;
+  uint64_t img_size;
+} TraceHeader;
+
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  uint64_t data;
+} TraceStore;
+
+static char *record_file = NULL;
+static char *replay_file = NULL;
+static FILE *record_fp = NULL;
+static uint8_t *replay_buf = NULL, *replay_cur = NULL, *replay_end = NULL;
+
+static DIFFTEST_REG_T trace_regs[DIFFTEST_NR_REG]; // register image of the last record
+static TraceStore trace_store[TRACE_MAX_STORE];
+static int trace_store_nr = 0;
+
+void difftest_set_trace(char *record, char *replay) {
+  record_file = record;
+  replay_file = replay;
+}
+
+bool trace_recording() {
+  return record_fp != NULL;
+}
+
+bool trace_replaying() {
+  return replay_buf != NULL;
+}
+
+void difftest_log_store(paddr_t addr, int len) {
+  if (trace_store_nr < TRACE_MAX_STORE) {
+    trace_store[trace_store_nr ++] = (TraceStore) { .addr = addr, .len = len };
+  }
+}
+
+// take the data stored by the last instruction
+static int take_stores() {
+  int nr = trace_store_nr;
+  for (int i = 0; i < nr; i ++) {
+    trace_store[i].data = host_read(guest_to_host(trace_store[i].addr), trace_store[i].len);
+  }
+  trace_store_nr = 0;
+  return nr;
+}
+
+int difftest_ref_stores(difftest_store_t *buf, int max);
+
+static void record_close() {
+  fclose(record_fp);
+  record_fp = NULL;
+}
+
+// called by assert_fail_msg() before NEMU aborts, since atexit() handlers are not run
+void trace_flush() {
+  if (record_fp != NULL) fflush(record_fp);
+}
+
+// record the result of an instruction, `ref_r' is NULL if it is skipped
+void trace_record(CPU_state *ref_r) {
+  if (record_fp == NULL) return;
+  DIFFTEST_REG_T buf[DIFFTEST_NR_REG];
+  TraceStore store[TRACE_MAX_STORE];
+  uint64_t head;
+  int nr_reg = 0, nr_store = 0;
+  trace_store_nr = 0; // the stores of DUT are not recorded
+  if (ref_r == NULL) {
+    memcpy(trace_regs, &cpu, DIFFTEST_REG_SIZE);
+    head = TRACE_SKIP;
+  } else {
+    head = difftest_pack_regs((DIFFTEST_REG_T *)ref_r, trace_regs, buf);
+    nr_reg = __builtin_popcountll(head);
+    difftest_store_t s[TRACE_MAX_STORE];
+    nr_store = difftest_ref_stores(s, TRACE_MAX_STORE);
+    Assert(nr_store >= 0, "The stores of REF are lost at pc = " FMT_WORD, cpu.pc);
+    for (int i = 0; i < nr_store; i ++) {
+      store[i] = (TraceStore) { .addr = s[i].addr, .len = s[i].len, .data = s[i].data };
+    }
+  }
+  head |= (uint64_t)nr_store << TRACE_NR_STORE_SHIFT;
+  fwrite(&head, sizeof(head), 1, record_fp);
+  fwrite(buf, sizeof(buf[0]), nr_reg, record_fp);
+  fwrite(store, sizeof(store[0]), nr_store, record_fp);
+}
+
+static void replay_fail(vaddr_t pc) {
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  isa_reg_display();
+}
+
+/* Return false if the trace ends before `size' bytes. */
+static bool replay_read(void *dst, size_t size) {
+  if (size > replay_end - replay_cur) return false;
+  memcpy(dst, replay_cur, size);
+  replay_cur += size;
+  return true;
+}
+
+static void replay_truncated(vaddr_t pc) {
+  Log("the trace ends before the instruction at pc = " FMT_WORD, pc);
+  replay_fail(pc);
+}
+
+/* Return false if not replaying. */
+bool trace_replay_step(vaddr_t pc) {
+  if (replay_buf == NULL) return false;
+
+  int nr_store = take_stores();
+  uint64_t head;
+  if (!replay_read(&head, sizeof(head))) {
+    replay_truncated(pc);
+    return true;
+  }
+  if (head & TRACE_SKIP) {
+    memcpy(trace_regs, &cpu, DIFFTEST_REG_SIZE);
+    return true;
+  }
+
+  uint64_t mask = head & (TRACE_SKIP - 1);
+  DIFFTEST_REG_T buf[DIFFTEST_NR_REG];
+  int ref_nr_store = head >> TRACE_NR_STORE_SHIFT;
+  if ((mask >> DIFFTEST_NR_REG) != 0 || ref_nr_store > TRACE_MAX_STORE) {
+    Log("the trace is corrupted at the instruction at pc = " FMT_WORD, pc);
+    replay_fail(pc);
+    return true;
+  }
+  TraceStore ref_store[TRACE_MAX_STORE];
+  if (!replay_read(buf, sizeof(buf[0]) * __builtin_popcountll(mask)) ||
+      !replay_read(ref_store, sizeof(ref_store[0]) * ref_nr_store)) {
+    replay_truncated(pc);
+    return true;
+  }
+  difftest_unpack_regs(trace_regs, buf, mask);
+
+  CPU_state ref_r;
+  memcpy(&ref_r, trace_regs, DIFFTEST_REG_SIZE);
+  if (!isa_difftest_checkregs(&ref_r, pc)) {
+    replay_fail(pc);
+    return true;
+  }
+
+  bool ok = (nr_store == ref_nr_store);
+  for (int i = 0; ok && i < nr_store; i ++) {
+    ok = (trace_store[i].addr == ref_store[i].addr && trace_store[i].len == ref_store[i].len &&
+        trace_store[i].data == ref_store[i].data);
+  }
+  if (!ok) {
+    Log("the stores of the instruction at pc = " FMT_WORD " are different from the trace", pc);
+    for (int i = 0; i < ref_nr_store; i ++) {
+      Log("right: %d bytes of 0x%" PRIx64 " to " FMT_PADDR, ref_store[i].len, ref_store[i].data, ref_store[i].addr);
+    }
+    for (int i = 0; i < nr_store; i ++) {
+      Log("wrong: %d bytes of 0x%" PRIx64 " to " FMT_PADDR, trace_store[i].len, trace_store[i].data, trace_store[i].addr);
+    }
+    replay_fail(pc);
+  }
+  return true;
+}
+
+/* Return true if DUT is checked against a recorded trace, and REF is not needed. */
+bool trace_init(long img_size) {
+  TraceHeader h = { .magic = TRACE_MAGIC, .version = TRACE_VERSION,
+    .reg_size = DIFFTEST_REG_SIZE, .img_size = img_size };
+  memcpy(trace_regs, &cpu, DIFFTEST_REG_SIZE);
+
+  if (replay_file != NULL) {
+    int fd = open(replay_file, O_RDONLY);
+    Assert(fd >= 0, "Can not open '%s'", replay_file);
+    struct stat st;
+    fstat(fd, &st);
+    Assert(st.st_size >= sizeof(h), "'%s' is not a trace", replay_file);
+    replay_buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    Assert(replay_buf != MAP_FAILED, "Can not map '%s'", replay_file);
+    close(fd);
+    madvise(replay_buf, st.st_size, MADV_SEQUENTIAL);
+
+    TraceHeader *rh = (TraceHeader *)replay_buf;
+    Assert(rh->magic == h.magic && rh->version == h.version && rh->reg_size == h.reg_size,
+        "'%s' is not a trace of this version or ISA", replay_file);
+    if (rh->img_size != h.img_size) {
+      Log("the trace is recorded with an image of %" PRIu64 " bytes, but the image has %ld bytes",
+          rh->img_size, img_size);
+    }
+    replay_cur = replay_buf + sizeof(h);
+    replay_end = replay_buf + st.st_size;
+    Log("Differential testing: %s, against the trace %s", ANSI_FMT("ON", ANSI_FG_GREEN), replay_file);
+    return true;
+  }
+
+  if (record_file != NULL) {
+    record_fp = fopen(record_file, "wb");
+    Assert(record_fp, "Can not open '%s'", record_file);
+    fwrite(&h, sizeof(h), 1, record_fp);
+    atexit(record_close);
+    Log("The commit trace of REF is recorded to %s", record_file);
+  }
+  return false;
+}
+#endif
@@ -0,0 +1,151 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/event.h>
+#include <cpu/cpu.h>
+
+/* The events are kept in a binary heap ordered by the instruction count
+ * when they are due, so that the execution loop only compares
+ * `g_nr_guest_inst' with the top of the heap. */
+
+#define MAX_EVENT 16
+
+typedef struct {
+  uint64_t when;
+  uint64_t period;
+  event_handler_t handler;
+  void *arg;
+  int id;
+  bool fixed; // not moved by event_skip() and event_rebase()
+} Event;
+
+static Event heap[MAX_EVENT];
+static int nr_event = 0;
+static int next_id = 0;
+
+uint64_t g_event_next_inst = UINT64_MAX;
+
+void smp_lock();
+void smp_unlock();
+
+static void swap(int i, int j) {
+  Event t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+}
+
+static void sift_up(int i) {
+  for (; i > 0 && heap[(i - 1) / 2].when > heap[i].when; i = (i - 1) / 2) {
+    swap(i, (i - 1) / 2);
+  }
+}
+
+static void sift_down(int i) {
+  while (true) {
+    int min = i, l = i * 2 + 1, r = i * 2 + 2;
+    if (l < nr_event && heap[l].when < heap[min].when) min = l;
+    if (r < nr_event && heap[r].when < heap[min].when) min = r;
+    if (min == i) break;
+    swap(i, min);
+    i = min;
+  }
+}
+
+static void heapify() {
+  for (int i = nr_event / 2 - 1; i >= 0; i --) sift_down(i);
+}
+
+static void update_next() {
+  g_event_next_inst = (nr_event > 0 ? heap[0].when : UINT64_MAX);
+}
+
+static void remove_at(int i) {
+  heap[i] = heap[-- nr_event];
+  if (i < nr_event) {
+    sift_down(i);
+    sift_up(i);
+  }
+}
+
+static int add(uint64_t when, uint64_t period, event_handler_t handler, void *arg, bool fixed) {
+  Assert(nr_event < MAX_EVENT, "Too many events");
+  int id = next_id ++;
+  heap[nr_event] = (Event) { .when = when, .period = period,
+    .handler = handler, .arg = arg, .id = id, .fixed = fixed };
+  sift_up(nr_event ++);
+  update_next();
+  return id;
+}
+
+int event_add(uint64_t delay, uint64_t period, event_handler_t handler, void *arg) {
+  return add(g_nr_guest_inst + delay, period, handler, arg, false);
+}
+
+int event_add_at(uint64_t inst, event_handler_t handler, void *arg) {
+  return add(inst, 0, handler, arg, true);
+}
+
+void event_cancel(int id) {
+  for (int i = 0; i < nr_event; i ++) {
+    if (heap[i].id == id) {
+      remove_at(i);
+      break;
+    }
+  }
+  update_next();
+}
+
+void event_run() {
+  // the handlers update the devices, which the other harts may access
+  IFDEF(CONFIG_SMP, smp_lock());
+  while (nr_event > 0 && heap[0].when <= g_nr_guest_inst) {
+    Event e = heap[0];
+    if (e.period != 0) {
+      heap[0].when += e.period;
+      sift_down(0);
+    } else {
+      remove_at(0);
+    }
+    // the handler may add or cancel events
+    update_next();
+    e.handler(e.arg);
+  }
+  update_next();
+  IFDEF(CONFIG_SMP, smp_unlock());
+}
+
+uint64_t event_skip() {
+  uint64_t when = UINT64_MAX;
+  for (int i = 0; i < nr_event; i ++) {
+    if (!heap[i].fixed && heap[i].when < when) when = heap[i].when;
+  }
+  if (when == UINT64_MAX || when <= g_nr_guest_inst) return 0;
+  uint64_t delta = when - g_nr_guest_inst;
+  for (int i = 0; i < nr_event; i ++) {
+    if (!heap[i].fixed) heap[i].when -= delta;
+  }
+  // the fixed events stay, so the order may change
+  heapify();
+  update_next();
+  return delta;
+}
+
+void event_rebase(uint64_t old_nr_inst) {
+  for (int i = 0; i < nr_event; i ++) {
+    if (!heap[i].fixed) heap[i].when += g_nr_guest_inst - old_nr_inst;
+  }
+  heapify();
+  update_next();
+}
@@ -0,0 +1,61 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+
+#ifdef CONFIG_IDLE_SKIP
+/* Detect the guest waiting in a polling loop, e.g.
+ *   while (io_read(AM_TIMER_UPTIME).us < t);
+ * An iteration of a loop runs from a backward jump to the next one with the
+ * same target, and the loop is idle if each iteration is short, reads the
+ * timer or an empty keyboard, and writes nothing but the current stack frame,
+ * i.e. the IDLE_FRAME_SIZE bytes from `sp' (see paddr_write()).
+ * After IDLE_NR_ITER idle iterations in a row, the virtual time skips to the
+ * next device update, where the guest may see something new.
+ */
+
+#define IDLE_LOOP_LEN 256
+#define IDLE_NR_ITER 16
+
+bool g_idle_polled = false;   // the timer or an empty keyboard is read
+bool g_idle_progress = false; // anything but the current stack frame is written
+
+static vaddr_t loop_pc = 0;
+static uint64_t loop_start = 0;
+static int nr_idle_iter = 0;
+
+void device_idle();
+
+// called by cpu_exec() after a jump to `target' which is not after the jump
+void idle_backward_jump(vaddr_t target) {
+  uint64_t len = g_nr_guest_inst - loop_start;
+  if (target != loop_pc) {
+    // a jump inside an iteration of the current loop, e.g. returning from io_read()
+    if (len <= IDLE_LOOP_LEN) return;
+    loop_pc = target;
+    nr_idle_iter = 0;
+  } else if (len <= IDLE_LOOP_LEN && g_idle_polled && !g_idle_progress) {
+    if (++ nr_idle_iter == IDLE_NR_ITER) {
+      nr_idle_iter = 0;
+      device_idle();
+    }
+  } else {
+    nr_idle_iter = 0;
+  }
+  loop_start = g_nr_guest_inst;
+  g_idle_polled = false;
+  g_idle_progress = false;
+}
+#endif
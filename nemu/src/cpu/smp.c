@@ -0,0 +1,103 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+
+#ifdef CONFIG_SMP
+#include <pthread.h>
+
+/* Hart 0 runs on the main thread with everything, e.g. sdb, tracing and
+ * the events of devices, while each of the other harts runs on its own
+ * thread, and only executes instructions. They run while hart 0 is in
+ * cpu_exec(), so that sdb sees all harts stopped, and they stop when
+ * `nemu_state' is no longer running, e.g. any hart executes `ebreak'.
+ * `cpu' is private to each thread, and pmem is shared. The devices are
+ * not thread-safe, so they are accessed with `dev_lock' held.
+ */
+
+static pthread_t hart[CONFIG_NR_HART];
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;  // a new round starts
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER; // a hart stops
+static bool running = false;
+static uint64_t round = 0;
+static int nr_busy = 0;
+static uint64_t nr_inst[CONFIG_NR_HART] = {};
+
+void init_isa_hart();
+
+void smp_lock() { pthread_mutex_lock(&dev_lock); }
+void smp_unlock() { pthread_mutex_unlock(&dev_lock); }
+
+static void *hart_main(void *arg) {
+  g_hart_id = (intptr_t)arg;
+  init_isa_hart();
+  uint64_t n = 0, my_round = 0;
+  Decode s;
+  pthread_mutex_lock(&run_lock);
+  while (true) {
+    while (round == my_round) pthread_cond_wait(&run_cond, &run_lock);
+    my_round = round;
+    pthread_mutex_unlock(&run_lock);
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED) && nemu_state.state == NEMU_RUNNING) {
+      s.pc = s.snpc = cpu.pc;
+      isa_exec_once(&s);
+      cpu.pc = s.dnpc;
+      n ++;
+    }
+
+    pthread_mutex_lock(&run_lock);
+    nr_inst[g_hart_id] = n;
+    if (-- nr_busy == 0) pthread_cond_signal(&park_cond);
+  }
+  return NULL;
+}
+
+// called by cpu_exec() before hart 0 runs
+void smp_resume() {
+  pthread_mutex_lock(&run_lock);
+  __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+  nr_busy = CONFIG_NR_HART - 1;
+  round ++;
+  pthread_cond_broadcast(&run_cond);
+  pthread_mutex_unlock(&run_lock);
+}
+
+// called by cpu_exec() after hart 0 stops, wait for the other harts to stop
+void smp_pause() {
+  __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&run_lock);
+  while (nr_busy > 0) pthread_cond_wait(&park_cond, &run_lock);
+  pthread_mutex_unlock(&run_lock);
+}
+
+// the number of instructions executed by the harts other than hart 0
+uint64_t smp_nr_inst() {
+  uint64_t sum = 0;
+  for (int i = 1; i < CONFIG_NR_HART; i ++) sum += nr_inst[i];
+  return sum;
+}
+
+void init_smp() {
+  for (intptr_t i = 1; i < CONFIG_NR_HART; i ++) {
+    Assert(pthread_create(&hart[i], NULL, hart_main, (void *)i) == 0, "Can not create the thread of hart %d", (int)i);
+  }
+  Log("%d harts are emulated, each on a host thread", CONFIG_NR_HART);
+}
+#endif
@@ -16,6 +16,8 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
+#include <cpu/event.h>
+#include <device/replay.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -28,26 +30,39 @@ void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
-void init_alarm();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
-  static uint64_t last = 0;
+#ifdef CONFIG_VIRTUAL_TIME
+// the number of instructions in a tick of the virtual time
+#define UPDATE_PERIOD ((uint64_t)CONFIG_VIRTUAL_TIME_MHZ * 1000000 / CONFIG_VIRTUAL_TIME_CPI / TIMER_HZ)
+#else
+// how often the host time is checked for a tick
+#define UPDATE_PERIOD 1024
+static uint64_t last_update = 0;
+#endif
+
+// called at every tick of TIMER_HZ
+static void device_update(void *arg) {
+#ifndef CONFIG_VIRTUAL_TIME
   uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
+  if (now - last_update < 1000000 / TIMER_HZ) {
     return;
   }
-  last = now;
+  last_update = now;
+#endif
 
+  IFNDEF(CONFIG_TARGET_AM, alarm_tick());
   IFDEF(CONFIG_HAS_VGA, vga_update_screen());
 
 #ifndef CONFIG_TARGET_AM
+  if (replay_headless()) return;
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
       case SDL_QUIT:
+        IFDEF(CONFIG_DEVICE_REPLAY, replay_log(INPUT_QUIT, 0));
         nemu_state.state = NEMU_QUIT;
         break;
 #ifdef CONFIG_HAS_KEYBOARD
@@ -56,6 +71,7 @@ void device_update() {
       case SDL_KEYUP: {
         uint8_t k = event.key.keysym.scancode;
         bool is_keydown = (event.key.type == SDL_KEYDOWN);
+        IFDEF(CONFIG_DEVICE_REPLAY, replay_log(INPUT_KEY, k | (is_keydown << 8)));
         send_key(k, is_keydown);
         break;
       }
@@ -66,8 +82,18 @@ void device_update() {
 #endif
 }
 
+#ifdef CONFIG_IDLE_SKIP
+void virtual_time_skip(uint64_t nr_inst);
+
+// nothing happens until the next event, skip to it in the virtual time
+void device_idle() {
+  virtual_time_skip(event_skip());
+}
+#endif
+
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
+  if (replay_headless()) return;
   SDL_Event event;
   while (SDL_PollEvent(&event));
 #endif
@@ -85,5 +111,5 @@ void init_device() {
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  event_add(UPDATE_PERIOD, UPDATE_PERIOD, device_update, NULL);
 }
@@ -32,6 +32,12 @@ uint8_t* new_space(int size) {
   return p;
 }
 
+// the space allocated by new_space() so far
+uint8_t* io_space_used(size_t *size) {
+  *size = p_space - io_space;
+  return io_space;
+}
+
 static void check_bound(IOMap *map, paddr_t addr) {
   if (map == NULL) {
     Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
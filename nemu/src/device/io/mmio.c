@@ -53,11 +53,22 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
   nr_map ++;
 }
 
+#ifdef CONFIG_SMP
+// the devices are shared by the harts
+void smp_lock();
+void smp_unlock();
+#endif
+
 /* bus interface */
 word_t mmio_read(paddr_t addr, int len) {
-  return map_read(addr, len, fetch_mmio_map(addr));
+  IFDEF(CONFIG_SMP, smp_lock());
+  word_t ret = map_read(addr, len, fetch_mmio_map(addr));
+  IFDEF(CONFIG_SMP, smp_unlock());
+  return ret;
 }
 
 void mmio_write(paddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_SMP, smp_lock());
   map_write(addr, len, data, fetch_mmio_map(addr));
+  IFDEF(CONFIG_SMP, smp_unlock());
 }
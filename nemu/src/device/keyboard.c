@@ -86,11 +86,18 @@ static void i8042_data_io_handler(uint32_t offset, int len, bool is_write) {
   assert(!is_write);
   assert(offset == 0);
   i8042_data_port_base[0] = key_dequeue();
+#ifdef CONFIG_IDLE_SKIP
+  extern bool g_idle_polled;
+  if (i8042_data_port_base[0] == NEMU_KEY_NONE) g_idle_polled = true;
+#endif
 }
 
 void init_i8042() {
   i8042_data_port_base = (uint32_t *)new_space(4);
   i8042_data_port_base[0] = NEMU_KEY_NONE;
+  IFDEF(CONFIG_CHECKPOINT, checkpoint_add_state("key_queue", key_queue, sizeof(key_queue), NULL));
+  IFDEF(CONFIG_CHECKPOINT, checkpoint_add_state("key_f", &key_f, sizeof(key_f), NULL));
+  IFDEF(CONFIG_CHECKPOINT, checkpoint_add_state("key_r", &key_r, sizeof(key_r), NULL));
 #ifdef CONFIG_HAS_PORT_IO
   add_pio_map ("keyboard", CONFIG_I8042_DATA_PORT, i8042_data_port_base, 4, i8042_data_io_handler);
 #else
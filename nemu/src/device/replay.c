@@ -0,0 +1,170 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <device/replay.h>
+#include <cpu/cpu.h>
+#include <cpu/event.h>
+
+/* Record and replay the inputs which make a run irreproducible.
+ * The file starts with a header, followed by the records in the order they
+ * happen, each of which is
+ *   LEB128(instructions since the previous record), type, LEB128(data)
+ * - A key and a quit come from SDL in device_update(), so on replay they are
+ *   scheduled as events fixed to the same instructions, which the idle skip
+ *   does not move. SDL is not used at all on replay.
+ * - An RTC value is read by the guest, so on replay it is taken when the
+ *   guest reads the RTC, which should happen at the same instruction.
+ */
+
+#define REPLAY_MAGIC 0x59504c52 // "RLPY"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t start_inst;
+} ReplayHeader;
+
+typedef struct {
+  uint64_t inst;
+  int type;
+  uint64_t data;
+} Record;
+
+int g_replay_mode = REPLAY_OFF;
+
+static FILE *fp = NULL;
+static char *record_file = NULL, *replay_file = NULL;
+static uint64_t last_inst = 0;
+static Record next = { .type = -1 };
+static uint64_t nr_record = 0;
+
+void send_key(uint8_t scancode, bool is_keydown);
+
+static void put_leb128(uint64_t v) {
+  do {
+    uint8_t b = v & 0x7f;
+    v >>= 7;
+    fputc(b | (v ? 0x80 : 0), fp);
+  } while (v);
+}
+
+static bool get_leb128(uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int b = fgetc(fp);
+    if (b == EOF) return false;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+void replay_log(int type, uint64_t data) {
+  if (g_replay_mode != REPLAY_RECORD) return;
+  put_leb128(g_nr_guest_inst - last_inst);
+  fputc(type, fp);
+  put_leb128(data);
+  last_inst = g_nr_guest_inst;
+  nr_record ++;
+}
+
+static void replay_event(void *arg);
+
+// read the next record, and schedule it if it does not wait for the guest
+static void fetch() {
+  uint64_t delta;
+  int type;
+  if (!get_leb128(&delta) || (type = fgetc(fp)) == EOF || !get_leb128(&next.data)) {
+    next.type = -1;
+    Log("All %" PRIu64 " inputs are replayed at instruction %" PRIu64, nr_record, g_nr_guest_inst);
+    return;
+  }
+  next.inst = last_inst + delta;
+  next.type = type;
+  last_inst = next.inst;
+  Assert(next.inst >= g_nr_guest_inst, "Replay diverges: input %" PRIu64 " should happen at "
+      "instruction %" PRIu64 ", but it is %" PRIu64 " now", nr_record, next.inst, g_nr_guest_inst);
+  if (type != INPUT_RTC) event_add_at(next.inst, replay_event, NULL);
+}
+
+static void replay_event(void *arg) {
+  switch (next.type) {
+    case INPUT_KEY: send_key(next.data & 0xff, next.data >> 8); break;
+    case INPUT_QUIT: nemu_state.state = NEMU_QUIT; break;
+    default: panic("Unknown input type %d in '%s'", next.type, replay_file);
+  }
+  nr_record ++;
+  fetch();
+}
+
+uint64_t replay_rtc(uint64_t us) {
+  if (g_replay_mode != REPLAY_PLAY) {
+    replay_log(INPUT_RTC, us);
+    return us;
+  }
+  Assert(next.type == INPUT_RTC && next.inst == g_nr_guest_inst,
+      "Replay diverges: the guest reads the RTC at instruction %" PRIu64
+      " and pc = " FMT_WORD ", which is not recorded", g_nr_guest_inst, cpu.pc);
+  us = next.data;
+  nr_record ++;
+  fetch();
+  return us;
+}
+
+// the mode is known before init_device(), which does not set up SDL on replay
+void replay_set_file(char *record, char *replay) {
+  if (record) record_file = record;
+  if (replay) replay_file = replay;
+  g_replay_mode = (replay_file ? REPLAY_PLAY : REPLAY_RECORD);
+}
+
+// keep the inputs recorded so far, since NEMU aborts without running replay_close()
+void replay_flush() {
+  if (fp != NULL && g_replay_mode == REPLAY_RECORD) fflush(fp);
+}
+
+static void replay_close() {
+  if (g_replay_mode == REPLAY_RECORD) {
+    Log("%" PRIu64 " inputs are recorded to %s", nr_record, record_file);
+  }
+  fclose(fp);
+}
+
+// called after the machine state is ready, e.g. restored from a checkpoint
+void init_replay() {
+  Assert(!(record_file && replay_file), "Can not record and replay at the same time");
+  ReplayHeader h;
+  if (record_file) {
+    fp = fopen(record_file, "wb");
+    Assert(fp, "Can not open '%s'", record_file);
+    h = (ReplayHeader) { .magic = REPLAY_MAGIC, .version = 1, .start_inst = g_nr_guest_inst };
+    fwrite(&h, sizeof(h), 1, fp);
+    Log("Inputs are recorded to %s", record_file);
+  } else if (replay_file) {
+    fp = fopen(replay_file, "rb");
+    Assert(fp, "Can not open '%s'", replay_file);
+    Assert(fread(&h, sizeof(h), 1, fp) == 1 && h.magic == REPLAY_MAGIC && h.version == 1,
+        "'%s' is not a record of inputs", replay_file);
+    Assert(h.start_inst == g_nr_guest_inst, "The record starts at instruction %" PRIu64
+        ", but NEMU starts at %" PRIu64, h.start_inst, g_nr_guest_inst);
+    Log("Inputs are replayed from %s, without SDL", replay_file);
+  } else {
+    return;
+  }
+  last_inst = g_nr_guest_inst;
+  atexit(replay_close);
+  if (g_replay_mode == REPLAY_PLAY) fetch();
+}
@@ -122,6 +122,12 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   }
 }
 
+#ifdef CONFIG_CHECKPOINT
+static void sdcard_restore() {
+  if (fp) fseek(fp, (blk_addr << 9) + addr, SEEK_SET);
+}
+#endif
+
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
@@ -131,4 +137,13 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+
+#ifdef CONFIG_CHECKPOINT
+  checkpoint_add_state("sdcard.blkcnt", &blkcnt, sizeof(blkcnt), NULL);
+  checkpoint_add_state("sdcard.write_cmd", &write_cmd, sizeof(write_cmd), NULL);
+  checkpoint_add_state("sdcard.read_ext_csd", &read_ext_csd, sizeof(read_ext_csd), NULL);
+  checkpoint_add_state("sdcard.addr", &addr, sizeof(addr), NULL);
+  // the file position is recovered from `blk_addr' and `addr'
+  checkpoint_add_state("sdcard.blk_addr", &blk_addr, sizeof(blk_addr), sdcard_restore);
+#endif
 }
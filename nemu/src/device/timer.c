@@ -16,13 +16,22 @@
 #include <device/map.h>
 #include <device/alarm.h>
 #include <utils.h>
+#include <device/replay.h>
 
 static uint32_t *rtc_port_base = NULL;
 
 static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
   assert(offset == 0 || offset == 4);
   if (!is_write && offset == 4) {
+#ifdef CONFIG_IDLE_SKIP
+    extern bool g_idle_polled;
+    g_idle_polled = true;
+#endif
     uint64_t us = get_time();
+#if defined(CONFIG_DEVICE_REPLAY) && !defined(CONFIG_VIRTUAL_TIME)
+    // the virtual time is deterministic, but the host time is not
+    us = replay_rtc(us);
+#endif
     rtc_port_base[0] = (uint32_t)us;
     rtc_port_base[1] = us >> 32;
   }
@@ -18,8 +18,14 @@ DIRS-y += src/cpu src/monitor src/utils
 DIRS-$(CONFIG_MODE_SYSTEM) += src/memory
 DIRS-BLACKLIST-$(CONFIG_TARGET_AM) += src/monitor/sdb
 
+ifdef CONFIG_GDBSTUB
+INC_PATH += $(NEMU_HOME)/tools/qemu-diff/include
+SRCS-y += tools/qemu-diff/src/protocol.c
+endif
+
 SHARE = $(if $(CONFIG_TARGET_SHARE),1,0)
 LIBS += $(if $(CONFIG_TARGET_NATIVE_ELF),-lreadline -ldl -pie,)
+LIBS += $(if $(CONFIG_DIFFTEST_PIPELINE)$(CONFIG_SMP)$(CONFIG_BATCH_RUN),-lpthread,)
 
 ifdef mainargs
 ASFLAGS += -DBIN_PATH=\"$(mainargs)\"
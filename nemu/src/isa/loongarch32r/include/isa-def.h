@@ -31,5 +31,6 @@ typedef struct {
 } loongarch32r_ISADecodeInfo;
 
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+#define isa_stack_pointer() (cpu.gpr[3])
 
 #endif
@@ -21,5 +21,7 @@ bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc) {
   return false;
 }
 
+// copy the architectural states of DUT to REF
 void isa_difftest_attach() {
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
 }
@@ -31,5 +31,6 @@ typedef struct {
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+#define isa_stack_pointer() (cpu.gpr[2])
 
 #endif
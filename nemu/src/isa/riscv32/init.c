@@ -15,6 +15,7 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <cpu/cpu.h>
 
 // this is not consistent with uint8_t
 // but it is ok since we do not access the array directly
@@ -32,7 +33,20 @@ static void restart() {
 
   /* The zero register is always 0. */
   cpu.gpr[0] = 0;
+
+#ifdef CONFIG_SMP
+  /* Like SBI, pass the hartid in $a0, and the number of harts in $a1. */
+  cpu.gpr[10] = g_hart_id;
+  cpu.gpr[11] = CONFIG_NR_HART;
+#endif
+}
+
+#ifdef CONFIG_SMP
+// called on the thread of each hart other than hart 0
+void init_isa_hart() {
+  restart();
 }
+#endif
 
 void init_isa() {
   /* Load built-in image. */
@@ -17,13 +17,17 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
 
 #define R(i) gpr(i)
 #define Mr vaddr_read
 #define Mw vaddr_write
 
+void device_idle();
+
 enum {
-  TYPE_I, TYPE_U, TYPE_S,
+  TYPE_I, TYPE_U, TYPE_S, TYPE_R,
   TYPE_N, // none
 };
 
@@ -42,9 +46,30 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
     case TYPE_I: src1R();          immI(); break;
     case TYPE_U:                   immU(); break;
     case TYPE_S: src1R(); src2R(); immS(); break;
+    case TYPE_R: src1R(); src2R();         break;
   }
 }
 
+// the reservation of lr.w, checked by sc.w with the value loaded,
+// and also cleared by the stores of the other harts under SMP
+static HART_LOCAL vaddr_t resv_addr = 0;
+static HART_LOCAL word_t resv_val = 0;
+static HART_LOCAL bool resv_valid = false;
+
+static word_t lr(vaddr_t addr) {
+  IFDEF(CONFIG_SMP, paddr_reserve(addr));
+  resv_addr = addr;
+  resv_val = Mr(addr, 4);
+  resv_valid = true;
+  return resv_val;
+}
+
+static word_t sc(vaddr_t addr, word_t data) {
+  bool ok = resv_valid && resv_addr == addr && vaddr_sc(addr, 4, resv_val, data);
+  resv_valid = false;
+  return !ok;
+}
+
 static int decode_exec(Decode *s) {
   int rd = 0;
   word_t src1 = 0, src2 = 0, imm = 0;
@@ -61,7 +86,23 @@ static int decode_exec(Decode *s) {
   INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = Mr(src1 + imm, 1));
   INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(src1 + imm, 1, src2));
 
+  INSTPAT("00010?? 00000 ????? 010 ????? 01011 11", lr_w     , R, R(rd) = SEXT(lr(src1), 32));
+  INSTPAT("00011?? ????? ????? 010 ????? 01011 11", sc_w     , R, R(rd) = sc(src1, src2));
+  INSTPAT("00001?? ????? ????? 010 ????? 01011 11", amoswap_w, R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_SWAP, src2), 32));
+  INSTPAT("00000?? ????? ????? 010 ????? 01011 11", amoadd_w , R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_ADD , src2), 32));
+  INSTPAT("00100?? ????? ????? 010 ????? 01011 11", amoxor_w , R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_XOR , src2), 32));
+  INSTPAT("01100?? ????? ????? 010 ????? 01011 11", amoand_w , R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_AND , src2), 32));
+  INSTPAT("01000?? ????? ????? 010 ????? 01011 11", amoor_w  , R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_OR  , src2), 32));
+  INSTPAT("10000?? ????? ????? 010 ????? 01011 11", amomin_w , R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_MIN , src2), 32));
+  INSTPAT("10100?? ????? ????? 010 ????? 01011 11", amomax_w , R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_MAX , src2), 32));
+  INSTPAT("11000?? ????? ????? 010 ????? 01011 11", amominu_w, R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_MINU, src2), 32));
+  INSTPAT("11100?? ????? ????? 010 ????? 01011 11", amomaxu_w, R, R(rd) = SEXT(vaddr_amo(src1, 4, AMO_MAXU, src2), 32));
+
+  // only mhartid can be read among the CSRs
+  INSTPAT("1111000 10100 00000 010 ????? 11100 11", csrr_mhartid, N, R(rd) = g_hart_id);
+
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
+  INSTPAT("0001000 00101 00000 000 00000 11100 11", wfi    , N, IFDEF(CONFIG_IDLE_SKIP, device_idle()));
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
   INSTPAT_END();
 
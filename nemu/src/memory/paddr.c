@@ -17,13 +17,57 @@
 #include <memory/paddr.h>
 #include <device/mmio.h>
 #include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/difftest.h>
 
 #if   defined(CONFIG_PMEM_MALLOC)
-static uint8_t *pmem = NULL;
+static MACHINE_LOCAL uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 #endif
 
+#ifdef CONFIG_PMEM_DIRTY
+#define NR_PMEM_PAGE (CONFIG_MSIZE >> PMEM_PAGE_SHIFT)
+static uint8_t pmem_dirty[NR_PMEM_PAGE] __attribute__((aligned(8))) = {};
+
+static inline void pmem_set_dirty(paddr_t addr, int len) {
+  pmem_dirty[(addr - CONFIG_MBASE) >> PMEM_PAGE_SHIFT] = 0xff;
+  pmem_dirty[(addr + len - 1 - CONFIG_MBASE) >> PMEM_PAGE_SHIFT] = 0xff;
+}
+
+void pmem_dirty_range(paddr_t addr, size_t len) {
+  if (len == 0) return;
+  uint32_t l = (addr - CONFIG_MBASE) >> PMEM_PAGE_SHIFT;
+  uint32_t r = (addr + len - 1 - CONFIG_MBASE) >> PMEM_PAGE_SHIFT;
+  memset(&pmem_dirty[l], 0xff, r - l + 1);
+}
+
+int pmem_dirty_scan(uint8_t consumer, paddr_t *pages, int max) {
+  int nr = 0;
+  for (int i = 0; i < NR_PMEM_PAGE && nr < max; i += 8) {
+    // skip 8 clean pages at once
+    if (*(uint64_t *)&pmem_dirty[i] == 0) continue;
+    for (int j = i; j < i + 8 && nr < max; j ++) {
+      if (pmem_dirty[j] & consumer) {
+        pmem_dirty[j] &= ~consumer;
+        pages[nr ++] = CONFIG_MBASE + ((paddr_t)j << PMEM_PAGE_SHIFT);
+      }
+    }
+  }
+  return nr;
+}
+#endif
+
+#ifdef CONFIG_IDLE_SKIP
+#define IDLE_FRAME_SIZE 256 // the stack written by a polling loop, starting from `sp'
+extern bool g_idle_progress;
+#endif
+
+#ifdef CONFIG_SNAPSHOT
+extern int g_snap_watch_len;
+void snapshot_watch_write(paddr_t addr, int len);
+#endif
+
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
@@ -33,9 +77,105 @@ static word_t pmem_read(paddr_t addr, int len) {
 }
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_DIFFTEST_STORE_LOG, difftest_log_store(addr, len));
+  IFDEF(CONFIG_PMEM_DIRTY, pmem_set_dirty(addr, len));
+  IFDEF(CONFIG_SNAPSHOT, if (unlikely(g_snap_watch_len)) snapshot_watch_write(addr, len));
   host_write(guest_to_host(addr), len, data);
 }
 
+#ifdef CONFIG_SMP
+/* The granule reserved by lr.w of each hart, with bit 0 set, or 0. A store
+ * to the granule clears the reservations of the other harts before it is
+ * written, so their sc.w fails even if the old value is written back. sc.w
+ * checks its reservation and does the CAS with the lock of the granule held,
+ * which the store also takes if it sees the granule reserved, so the store
+ * either clears the reservation before sc.w, or is written after it. */
+#define RESV_GRANULE(addr) (((addr) & ~(paddr_t)7) | 1)
+#define NR_RESV_LOCK 64
+static paddr_t resv[CONFIG_NR_HART] = {};
+static bool resv_lock[NR_RESV_LOCK] = {};
+
+static bool *resv_lock_of(paddr_t g) {
+  return &resv_lock[(g >> 3) % NR_RESV_LOCK];
+}
+
+static void resv_acquire(bool *lock) {
+  while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE));
+}
+
+static void resv_release(bool *lock) {
+  __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+// clear the reservations of the other harts on the granule `g', with its lock held
+static void resv_clear_locked(paddr_t g) {
+  for (int i = 0; i < CONFIG_NR_HART; i ++) {
+    paddr_t e = g;
+    if (i != g_hart_id) __atomic_compare_exchange_n(&resv[i], &e, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  }
+}
+
+static void resv_clear(paddr_t addr) {
+  paddr_t g = RESV_GRANULE(addr);
+  for (int i = 0; i < CONFIG_NR_HART; i ++) {
+    if (i != g_hart_id && __atomic_load_n(&resv[i], __ATOMIC_SEQ_CST) == g) {
+      bool *lock = resv_lock_of(g);
+      resv_acquire(lock);
+      resv_clear_locked(g);
+      resv_release(lock);
+      return;
+    }
+  }
+}
+
+void paddr_reserve(paddr_t addr) {
+  __atomic_store_n(&resv[g_hart_id], RESV_GRANULE(addr), __ATOMIC_SEQ_CST);
+}
+
+static bool host_cas(void *haddr, int len, word_t *old, word_t data) {
+  switch (len) {
+    case 4: {
+      uint32_t o = *old;
+      bool ok = __atomic_compare_exchange_n((uint32_t *)haddr, &o, data, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      *old = o;
+      return ok;
+    }
+#ifdef CONFIG_ISA64
+    case 8: return __atomic_compare_exchange_n((uint64_t *)haddr, old, data, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+    default: panic("Atomic access of %d bytes is not supported", len);
+  }
+}
+
+static uint8_t *atomic_to_host(paddr_t addr, int len) {
+  Assert(in_pmem(addr) && addr % len == 0, "Atomic access to address = " FMT_PADDR
+      " is not in pmem or not aligned at pc = " FMT_WORD, addr, cpu.pc);
+  IFDEF(CONFIG_PMEM_DIRTY, pmem_set_dirty(addr, len));
+  return guest_to_host(addr);
+}
+
+word_t paddr_amo(paddr_t addr, int len, int op, word_t data) {
+  uint8_t *haddr = atomic_to_host(addr, len);
+  resv_clear(addr);
+  word_t old = host_read(haddr, len);
+  while (!host_cas(haddr, len, &old, amo_result(op, old, data, len)));
+  return old;
+}
+
+bool paddr_sc(paddr_t addr, int len, word_t old, word_t data) {
+  uint8_t *haddr = atomic_to_host(addr, len);
+  paddr_t g = RESV_GRANULE(addr);
+  bool *lock = resv_lock_of(g);
+  resv_acquire(lock);
+  bool ok = __atomic_load_n(&resv[g_hart_id], __ATOMIC_SEQ_CST) == g &&
+    host_cas(haddr, len, &old, data);
+  if (ok) resv_clear_locked(g);
+  __atomic_store_n(&resv[g_hart_id], 0, __ATOMIC_SEQ_CST);
+  resv_release(lock);
+  return ok;
+}
+#endif
+
 static void out_of_bound(paddr_t addr) {
   panic("address = " FMT_PADDR " is out of bound of pmem [" FMT_PADDR ", " FMT_PADDR "] at pc = " FMT_WORD,
       addr, PMEM_LEFT, PMEM_RIGHT, cpu.pc);
@@ -50,6 +190,17 @@ void init_mem() {
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
+#ifdef CONFIG_BATCH_RUN
+/* Give the next image run by this thread fresh pmem as a new process has,
+ * and return the pages written by the last image to the host. */
+void reset_mem() {
+  free(pmem);
+  pmem = malloc(CONFIG_MSIZE);
+  assert(pmem);
+  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+}
+#endif
+
 word_t paddr_read(paddr_t addr, int len) {
   if (likely(in_pmem(addr))) return pmem_read(addr, len);
   IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
@@ -58,7 +209,15 @@ word_t paddr_read(paddr_t addr, int len) {
 }
 
 void paddr_write(paddr_t addr, int len, word_t data) {
-  if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
+  if (likely(in_pmem(addr))) {
+    // the frame of a polling loop is rewritten in each iteration, e.g. by io_read(),
+    // while the heap and the rest of the stack may be the progress of the guest
+    IFDEF(CONFIG_IDLE_SKIP, if (addr - (paddr_t)isa_stack_pointer() >= IDLE_FRAME_SIZE) g_idle_progress = true);
+    IFDEF(CONFIG_SMP, resv_clear(addr));
+    pmem_write(addr, len, data);
+    return;
+  }
+  IFDEF(CONFIG_IDLE_SKIP, g_idle_progress = true);
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
 }
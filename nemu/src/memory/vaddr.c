@@ -16,6 +16,10 @@
 #include <isa.h>
 #include <memory/paddr.h>
 
+void gdbstub_check_watch(vaddr_t addr, int len);
+void difftest_log_vstore(vaddr_t addr, int len, word_t data);
+void ref_log_store(vaddr_t addr, int len, word_t data);
+
 word_t vaddr_ifetch(vaddr_t addr, int len) {
   return paddr_read(addr, len);
 }
@@ -25,5 +29,30 @@ word_t vaddr_read(vaddr_t addr, int len) {
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_GDBSTUB, gdbstub_check_watch(addr, len));
+  IFDEF(CONFIG_DIFFTEST_STORESTREAM, difftest_log_vstore(addr, len, data));
+  IFDEF(CONFIG_TARGET_SHARE, ref_log_store(addr, len, data));
   paddr_write(addr, len, data);
 }
+
+/* The other harts can not run between the read and the write unless
+ * CONFIG_SMP, where the host atomics are used. */
+word_t vaddr_amo(vaddr_t addr, int len, int op, word_t data) {
+#ifdef CONFIG_SMP
+  return paddr_amo(addr, len, op, data);
+#else
+  word_t old = vaddr_read(addr, len);
+  vaddr_write(addr, len, amo_result(op, old, data, len));
+  return old;
+#endif
+}
+
+bool vaddr_sc(vaddr_t addr, int len, word_t old, word_t data) {
+#ifdef CONFIG_SMP
+  return paddr_sc(addr, len, old, data);
+#else
+  if (vaddr_read(addr, len) != old) return false;
+  vaddr_write(addr, len, data);
+  return true;
+#endif
+}
@@ -0,0 +1,147 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+
+#ifdef CONFIG_BATCH_RUN
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+/* Run the images in a list on worker threads. Each worker has its own
+ * machine, since `cpu', pmem and `nemu_state' are MACHINE_LOCAL, and runs
+ * the images one by one, with the machine reset as a new process would do.
+ * A panic longjmp()s back to the worker, and only fails the image causing it.
+ */
+
+typedef struct {
+  char *file;
+  const char *result;
+  vaddr_t pc;
+  uint64_t nr_inst;
+  uint64_t us;
+} Run;
+
+__thread bool g_batch_worker = false;
+
+static __thread jmp_buf recover_jmp;
+static Run *run = NULL;
+static int nr_run = 0;
+static int next_run = 0;
+static int nr_fail = 0;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void reset_mem();
+
+// called by assert_fail_msg() before NEMU aborts
+void batch_run_recover() {
+  if (g_batch_worker) longjmp(recover_jmp, 1);
+}
+
+static bool load(const char *file) {
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL) return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  bool ok = (size > 0 && size <= CONFIG_MSIZE - CONFIG_PC_RESET_OFFSET &&
+      fread(guest_to_host(RESET_VECTOR), size, 1, fp) == 1);
+  fclose(fp);
+  return ok;
+}
+
+static void run_one(Run *r) {
+  reset_mem();
+  init_isa();
+  nemu_state = (NEMUState) { .state = NEMU_STOP };
+  g_nr_guest_inst = 0;
+  if (!load(r->file)) {
+    r->result = "can not load";
+    return;
+  }
+
+  uint64_t start = get_host_time();
+  if (setjmp(recover_jmp) == 0) {
+    cpu_exec(-1);
+    r->result = (nemu_state.state == NEMU_ABORT ? "ABORT" :
+        (nemu_state.halt_ret == 0 ? "HIT GOOD TRAP" : "HIT BAD TRAP"));
+    r->pc = nemu_state.halt_pc;
+  } else {
+    r->result = "panic";
+    r->pc = cpu.pc;
+  }
+  r->us = get_host_time() - start;
+  r->nr_inst = g_nr_guest_inst;
+}
+
+static void *worker(void *arg) {
+  g_batch_worker = true;
+  while (true) {
+    int i = __atomic_fetch_add(&next_run, 1, __ATOMIC_RELAXED);
+    if (i >= nr_run) break;
+    Run *r = &run[i];
+    run_one(r);
+
+    bool good = (strcmp(r->result, "HIT GOOD TRAP") == 0);
+    pthread_mutex_lock(&print_lock);
+    if (!good) nr_fail ++;
+    printf("[%d/%d] %s: %s at pc = " FMT_WORD ", %" PRIu64 " instructions in %" PRIu64 " us\n",
+        i + 1, nr_run, r->file, r->result, r->pc, r->nr_inst, r->us);
+    fflush(stdout);
+    pthread_mutex_unlock(&print_lock);
+  }
+  return NULL;
+}
+
+static void read_list(const char *file) {
+  FILE *fp = fopen(file, "r");
+  Assert(fp, "Can not open '%s'", file);
+  char line[4096];
+  int max = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') continue;
+    if (nr_run == max) {
+      max = (max == 0 ? 64 : max * 2);
+      run = realloc(run, sizeof(run[0]) * max);
+      assert(run);
+    }
+    run[nr_run ++] = (Run) { .file = strdup(line), .result = "not run" };
+  }
+  fclose(fp);
+}
+
+/* Run the images listed in `file' with `nr_job' workers, or one worker
+ * for each host CPU if `nr_job' is 0, and exit. */
+void batch_run(const char *file, int nr_job) {
+  read_list(file);
+  Assert(nr_run > 0, "No image is listed in '%s'", file);
+  if (nr_job <= 0) nr_job = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nr_job > nr_run) nr_job = nr_run;
+  Log("Run %d images with %d workers", nr_run, nr_job);
+
+  uint64_t start = get_host_time();
+  pthread_t thread[nr_job];
+  for (int i = 0; i < nr_job; i ++) {
+    Assert(pthread_create(&thread[i], NULL, worker, NULL) == 0, "Can not create worker %d", i);
+  }
+  for (int i = 0; i < nr_job; i ++) pthread_join(thread[i], NULL);
+
+  Log("%d/%d images hit good trap in %" PRIu64 " us", nr_run - nr_fail, nr_run, get_host_time() - start);
+  exit(nr_fail != 0);
+}
+#endif
@@ -0,0 +1,60 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+
+#ifndef CONFIG_TARGET_AM
+#include <elf.h>
+
+typedef MUXDEF(CONFIG_ISA64, Elf64_Ehdr, Elf32_Ehdr) Ehdr;
+typedef MUXDEF(CONFIG_ISA64, Elf64_Shdr, Elf32_Shdr) Shdr;
+typedef MUXDEF(CONFIG_ISA64, Elf64_Sym, Elf32_Sym) Sym;
+
+/* Find the value of the symbol `name' in the symbol table of the ELF file of
+ * the guest program. Return false if it is not found. */
+bool elf_find_symbol(const char *file, const char *name, word_t *value) {
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL) return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  uint8_t *buf = malloc(size);
+  bool ok = (buf != NULL && size >= sizeof(Ehdr) && fread(buf, size, 1, fp) == 1);
+  fclose(fp);
+
+  Ehdr *eh = (Ehdr *)buf;
+  ok = ok && memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0 &&
+    eh->e_ident[EI_CLASS] == MUXDEF(CONFIG_ISA64, ELFCLASS64, ELFCLASS32) &&
+    eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Shdr) <= size;
+  bool found = false;
+  for (int i = 0; ok && !found && i < eh->e_shnum; i ++) {
+    Shdr *sh = (Shdr *)(buf + eh->e_shoff) + i;
+    if (sh->sh_type != SHT_SYMTAB || sh->sh_link >= eh->e_shnum) continue;
+    Shdr *str = (Shdr *)(buf + eh->e_shoff) + sh->sh_link;
+    if (sh->sh_offset + sh->sh_size > size || str->sh_offset + str->sh_size > size) continue;
+    Sym *sym = (Sym *)(buf + sh->sh_offset);
+    for (int j = 0; j < sh->sh_size / sizeof(Sym); j ++) {
+      if (sym[j].st_name < str->sh_size &&
+          strncmp((char *)buf + str->sh_offset + sym[j].st_name, name, str->sh_size - sym[j].st_name) == 0) {
+        *value = sym[j].st_value;
+        found = true;
+        break;
+      }
+    }
+  }
+  free(buf);
+  return found;
+}
+#endif
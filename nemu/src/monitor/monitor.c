@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <cpu/cpu.h>
 #include <memory/paddr.h>
 
 void init_rand();
@@ -38,10 +39,31 @@ static void welcome() {
 #include <getopt.h>
 
 void sdb_set_batch_mode();
+void gdbstub_set_addr(char *addr);
+void difftest_set_trace(char *record, char *replay);
+void replay_set_file(char *record, char *replay);
+void init_replay();
+void init_smp();
+void batch_run(const char *file, int nr_job);
+bool checkpoint_restore(const char *file);
+void init_checkpoint(char *prefix, uint64_t interval);
+void checkpoint_set_simpoint(const char *file, uint64_t interval);
+void init_bbv(const char *file, uint64_t interval, vaddr_t pc);
+bool elf_find_symbol(const char *file, const char *name, word_t *value);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *restore_file = NULL;
+static char *ckpt_prefix = "ckpt";
+static uint64_t ckpt_interval = 0;
+static char *bbv_file = NULL;
+static char *simpoint_file = NULL;
+static uint64_t sp_interval = 10000000;
+static char *ff_trigger = NULL;
+static char *elf_file = NULL;
+static char *run_list = NULL;
+static int nr_job = 0;
 static int difftest_port = 1234;
 
 static long load_img() {
@@ -66,22 +88,87 @@ static long load_img() {
   return size;
 }
 
+static void fast_forward() {
+  if (ff_trigger == NULL) return;
+  char *end = NULL;
+  word_t pc = 0;
+  if (strncmp(ff_trigger, "0x", 2) == 0) {
+    pc = strtoull(ff_trigger, &end, 16);
+    Assert(*end == '\0', "Invalid pc '%s' to fast-forward to", ff_trigger);
+    cpu_fast_forward(UINT64_MAX, true, pc);
+    return;
+  }
+  uint64_t nr_inst = strtoull(ff_trigger, &end, 10);
+  if (end != ff_trigger && *end == '\0') {
+    cpu_fast_forward(nr_inst, false, 0);
+    return;
+  }
+
+  // a symbol of the guest program
+  char *file = elf_file;
+  size_t len = (img_file ? strlen(img_file) : 0);
+  if (file == NULL && len > 4 && strcmp(img_file + len - 4, ".bin") == 0) {
+    file = strdup(img_file);
+    strcpy(file + len - 4, ".elf");
+  }
+  Assert(file != NULL, "Give the ELF file with --elf to find the symbol '%s'", ff_trigger);
+  Assert(elf_find_symbol(file, ff_trigger, &pc), "Can not find the symbol '%s' in '%s'", ff_trigger, file);
+  cpu_fast_forward(UINT64_MAX, true, pc);
+}
+
+// the option is given, but the feature for it is not built in
+static void option_unsupported(const char *name) {
+  printf("Option --%s is not supported, enable the feature for it in menuconfig\n", name);
+  exit(1);
+}
+
 static int parse_args(int argc, char *argv[]) {
   const struct option table[] = {
     {"batch"    , no_argument      , NULL, 'b'},
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"gdb"      , required_argument, NULL, 'g'},
+    {"diff-record", required_argument, NULL, 'R'},
+    {"diff-replay", required_argument, NULL, 'P'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"ckpt-interval", required_argument, NULL, 'I'},
+    {"ckpt-prefix", required_argument, NULL, 'X'},
+    {"bbv"      , required_argument, NULL, 'B'},
+    {"simpoint" , required_argument, NULL, 'S'},
+    {"sp-interval", required_argument, NULL, 'N'},
+    {"fast-forward", required_argument, NULL, 'F'},
+    {"elf"      , required_argument, NULL, 'E'},
+    {"record"   , required_argument, NULL, 'W'},
+    {"replay"   , required_argument, NULL, 'Y'},
+    {"run-list" , required_argument, NULL, 'L'},
+    {"jobs"     , required_argument, NULL, 'J'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:g:r:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'g': MUXDEF(CONFIG_GDBSTUB, gdbstub_set_addr(optarg), option_unsupported("gdb")); break;
+      case 'R': MUXDEF(CONFIG_DIFFTEST_TRACE, difftest_set_trace(optarg, NULL), option_unsupported("diff-record")); break;
+      case 'P': MUXDEF(CONFIG_DIFFTEST_TRACE, difftest_set_trace(NULL, optarg), option_unsupported("diff-replay")); break;
+      case 'r': IFNDEF(CONFIG_CHECKPOINT, option_unsupported("restore")); restore_file = optarg; break;
+      case 'I': IFNDEF(CONFIG_CHECKPOINT, option_unsupported("ckpt-interval")); sscanf(optarg, "%" SCNu64, &ckpt_interval); break;
+      case 'X': IFNDEF(CONFIG_CHECKPOINT, option_unsupported("ckpt-prefix")); ckpt_prefix = optarg; break;
+      case 'B': IFNDEF(CONFIG_BBV, option_unsupported("bbv")); bbv_file = optarg; break;
+      case 'S': IFNDEF(CONFIG_CHECKPOINT, option_unsupported("simpoint")); simpoint_file = optarg; break;
+      case 'N': IFNDEF(CONFIG_BBV, IFNDEF(CONFIG_CHECKPOINT, option_unsupported("sp-interval")));
+                sscanf(optarg, "%" SCNu64, &sp_interval); break;
+      case 'F': ff_trigger = optarg; break;
+      case 'E': elf_file = optarg; break;
+      case 'W': MUXDEF(CONFIG_DEVICE_REPLAY, replay_set_file(optarg, NULL), option_unsupported("record")); break;
+      case 'Y': MUXDEF(CONFIG_DEVICE_REPLAY, replay_set_file(NULL, optarg), option_unsupported("replay")); break;
+      case 'L': IFNDEF(CONFIG_BATCH_RUN, option_unsupported("run-list")); run_list = optarg; break;
+      case 'J': IFNDEF(CONFIG_BATCH_RUN, option_unsupported("jobs")); sscanf(optarg, "%d", &nr_job); break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -89,6 +176,24 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        IFDEF(CONFIG_GDBSTUB, printf("\t-g,--gdb=PORT|SOCKET    wait for GDB on TCP PORT or UNIX SOCKET\n"));
+        IFDEF(CONFIG_DIFFTEST_TRACE, printf("\t--diff-record=FILE      record the commit trace of REF to FILE\n"));
+        IFDEF(CONFIG_DIFFTEST_TRACE, printf("\t--diff-replay=FILE      run DiffTest against the trace in FILE without REF\n"));
+        IFDEF(CONFIG_CHECKPOINT, printf("\t-r,--restore=FILE       start from the checkpoint in FILE\n"));
+        IFDEF(CONFIG_CHECKPOINT, printf("\t--ckpt-interval=N       take a checkpoint every N instructions\n"));
+        IFDEF(CONFIG_CHECKPOINT, printf("\t--ckpt-prefix=PREFIX    name the periodic checkpoints PREFIX.N (default: ckpt)\n"));
+        IFDEF(CONFIG_CHECKPOINT, printf("\t--simpoint=FILE         take checkpoints at the intervals chosen by tools/simpoint\n"));
+        IFDEF(CONFIG_BBV, printf("\t--bbv=FILE              write the basic-block vector of every interval to FILE\n"));
+#if defined(CONFIG_BBV) || defined(CONFIG_CHECKPOINT)
+        printf("\t--sp-interval=N         length of the intervals of SimPoint (default: 10000000)\n");
+#endif
+        printf("\t--fast-forward=TRIGGER  run at full speed to TRIGGER, an instruction count N,\n");
+        printf("\t                        a pc 0xADDR or a symbol, before tracing and checking\n");
+        printf("\t--elf=FILE              look up symbols in FILE (default: IMAGE with .elf for .bin)\n");
+        IFDEF(CONFIG_DEVICE_REPLAY, printf("\t--record=FILE           record the inputs of devices to FILE\n"));
+        IFDEF(CONFIG_DEVICE_REPLAY, printf("\t--replay=FILE           feed the inputs of devices recorded in FILE\n"));
+        IFDEF(CONFIG_BATCH_RUN, printf("\t--run-list=FILE         run the images listed in FILE in parallel, and exit\n"));
+        IFDEF(CONFIG_BATCH_RUN, printf("\t--jobs=N                run N images at a time (default: number of host CPUs)\n"));
         printf("\n");
         exit(0);
     }
@@ -108,6 +213,9 @@ void init_monitor(int argc, char *argv[]) {
   /* Open the log file. */
   init_log(log_file);
 
+  /* Run the images in the list instead, each on a machine of its own. */
+  IFDEF(CONFIG_BATCH_RUN, if (run_list != NULL) batch_run(run_list, nr_job));
+
   /* Initialize memory. */
   init_mem();
 
@@ -117,12 +225,36 @@ void init_monitor(int argc, char *argv[]) {
   /* Perform ISA dependent initialization. */
   init_isa();
 
+  /* Start the threads of the other harts. */
+  IFDEF(CONFIG_SMP, init_smp());
+
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
 
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
+  /* Restore the checkpoint, and bring the reference design in sync with it. */
+#ifdef CONFIG_CHECKPOINT
+  if (restore_file != NULL && !checkpoint_restore(restore_file)) {
+    panic("Can not restore the checkpoint '%s'", restore_file);
+  }
+#endif
+
+  /* Record or replay the inputs of devices from here. */
+  IFDEF(CONFIG_DEVICE_REPLAY, init_replay());
+
+  /* Fast-forward to the trigger, where tracing and checking start. */
+  fast_forward();
+
+#ifdef CONFIG_CHECKPOINT
+  if (simpoint_file != NULL) checkpoint_set_simpoint(simpoint_file, sp_interval);
+  init_checkpoint(ckpt_prefix, ckpt_interval);
+#endif
+
+  /* Profile the basic blocks for SimPoint. */
+  IFDEF(CONFIG_BBV, init_bbv(bbv_file, sp_interval, cpu.pc));
+
   /* Initialize the simple debugger. */
   init_sdb();
 
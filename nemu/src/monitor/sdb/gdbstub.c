@@ -0,0 +1,332 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#include <difftest-def.h>
+
+#ifdef CONFIG_GDBSTUB
+#include <protocol.h>
+#include <ctype.h>
+
+/* The register file seen by GDB is the same as the one seen by the
+ * reference design in differential testing, i.e. the first
+ * DIFFTEST_REG_SIZE bytes of `cpu'. See `isa_gdb_regs' in qemu-diff.
+ */
+#define NR_GDB_REG (DIFFTEST_REG_SIZE / sizeof(word_t))
+
+#define PACKET_SIZE 0x4000
+#define NR_BP 32
+#define NR_WATCH 8
+
+typedef struct {
+  vaddr_t addr;
+  int len;
+} GDBWatch;
+
+enum { STOP_NONE, STOP_BP, STOP_WATCH, STOP_RANGE, STOP_INTR };
+
+static struct gdb_conn *conn = NULL;
+static char *gdb_addr = NULL;
+static char reply[PACKET_SIZE + 1];
+
+static vaddr_t bp[NR_BP];
+static int nr_bp = 0;
+static GDBWatch watch[NR_WATCH];
+static int nr_watch = 0;
+
+static bool range_step = false;
+static vaddr_t range_start = 0, range_end = 0;
+static int stop_reason = STOP_NONE;
+static bool watch_hit = false;
+static vaddr_t watch_hit_addr = 0;
+static uint32_t poll_cnt = 0;
+
+void gdbstub_set_addr(char *addr) {
+  gdb_addr = addr;
+}
+
+static void gdb_stop(int reason) {
+  stop_reason = reason;
+  nemu_state.state = NEMU_STOP;
+}
+
+// called after each instruction with the pc of the next instruction
+void gdbstub_check_stop(vaddr_t pc) {
+  if (range_step && (pc < range_start || pc >= range_end)) {
+    gdb_stop(STOP_RANGE);
+    return;
+  }
+  for (int i = 0; i < nr_bp; i ++) {
+    if (bp[i] == pc) { gdb_stop(STOP_BP); return; }
+  }
+  if (watch_hit) {
+    gdb_stop(STOP_WATCH);
+    return;
+  }
+  if (((++ poll_cnt) & 0xffff) == 0 && conn != NULL && gdb_poll_interrupt(conn)) {
+    gdb_stop(STOP_INTR);
+  }
+}
+
+void gdbstub_check_watch(vaddr_t addr, int len) {
+  for (int i = 0; i < nr_watch; i ++) {
+    if (addr < watch[i].addr + watch[i].len && addr + len > watch[i].addr) {
+      watch_hit = true;
+      watch_hit_addr = watch[i].addr;
+      return;
+    }
+  }
+}
+
+static void send_reply(const char *str) {
+  gdb_send(conn, (const uint8_t *)str, strlen(str));
+}
+
+static char* encode_hex(char *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i ++) {
+    *dst ++ = hex_encode(src[i] >> 4);
+    *dst ++ = hex_encode(src[i] & 0xf);
+  }
+  *dst = '\0';
+  return dst;
+}
+
+// nothing is written to `dst' unless `src' has `n' bytes of valid hex
+static bool decode_hex(uint8_t *dst, const char *src, size_t n) {
+  for (size_t i = 0; i < 2 * n; i ++) {
+    if (!isxdigit(src[i])) return false;
+  }
+  for (size_t i = 0; i < n; i ++) {
+    dst[i] = gdb_decode_hex(src[2 * i], src[2 * i + 1]);
+  }
+  return true;
+}
+
+// in 64 bits, so that a large `addr' or `len' from GDB does not wrap around
+static bool in_pmem_range(uint64_t addr, uint64_t len) {
+  return len == 0 || (addr >= PMEM_LEFT && addr <= PMEM_RIGHT && len <= PMEM_RIGHT - addr + 1);
+}
+
+static void read_mem(const char *args) {
+  char *end;
+  uint64_t addr = strtoull(args, &end, 16);
+  size_t len = strtoull(end + 1, NULL, 16);
+  if (len > PACKET_SIZE / 2) len = PACKET_SIZE / 2;
+  // only physical memory is exposed, reading MMIO has side effects
+  if (!in_pmem_range(addr, len)) { send_reply("E14"); return; }
+  encode_hex(reply, guest_to_host(addr), len);
+  send_reply(reply);
+}
+
+static void write_mem(const char *args) {
+  char *end;
+  uint64_t addr = strtoull(args, &end, 16);
+  uint64_t len = strtoull(end + 1, &end, 16);
+  if (*end != ':' || !in_pmem_range(addr, len) || strlen(end + 1) < 2 * len ||
+      !decode_hex(guest_to_host(addr), end + 1, len)) {
+    send_reply("E14");
+    return;
+  }
+  IFDEF(CONFIG_PMEM_DIRTY, pmem_dirty_range(addr, len));
+  send_reply("OK");
+}
+
+static void read_regs() {
+  encode_hex(reply, (uint8_t *)&cpu, DIFFTEST_REG_SIZE);
+  send_reply(reply);
+}
+
+static void write_regs(const char *args) {
+  uint8_t buf[DIFFTEST_REG_SIZE];
+  if (strlen(args) < DIFFTEST_REG_SIZE * 2 || !decode_hex(buf, args, DIFFTEST_REG_SIZE)) {
+    send_reply("E01");
+    return;
+  }
+  memcpy(&cpu, buf, DIFFTEST_REG_SIZE);
+  send_reply("OK");
+}
+
+static void read_reg(const char *args) {
+  size_t idx = strtoull(args, NULL, 16);
+  if (idx >= NR_GDB_REG) { send_reply("E01"); return; }
+  encode_hex(reply, (uint8_t *)&((word_t *)&cpu)[idx], sizeof(word_t));
+  send_reply(reply);
+}
+
+static void write_reg(const char *args) {
+  char *end;
+  size_t idx = strtoull(args, &end, 16);
+  word_t val;
+  if (idx >= NR_GDB_REG || *end != '=' || !decode_hex((uint8_t *)&val, end + 1, sizeof(val))) {
+    send_reply("E01");
+    return;
+  }
+  ((word_t *)&cpu)[idx] = val;
+  send_reply("OK");
+}
+
+// Z/z packets: "Ztype,addr,kind"
+static void set_point(const char *args, bool insert) {
+  char *end;
+  int type = strtol(args, &end, 16);
+  vaddr_t addr = strtoull(end + 1, &end, 16);
+  int len = strtol(end + 1, NULL, 16);
+  int i;
+
+  switch (type) {
+    case 0: case 1: // software and hardware breakpoints are the same to NEMU
+      for (i = 0; i < nr_bp && bp[i] != addr; i ++);
+      if (insert && i == nr_bp) {
+        if (nr_bp == NR_BP) { send_reply("E22"); return; }
+        bp[nr_bp ++] = addr;
+      } else if (!insert && i < nr_bp) {
+        bp[i] = bp[-- nr_bp];
+      }
+      break;
+    case 2: // write watchpoint
+      for (i = 0; i < nr_watch && (watch[i].addr != addr || watch[i].len != len); i ++);
+      if (insert && i == nr_watch) {
+        if (nr_watch == NR_WATCH) { send_reply("E22"); return; }
+        watch[nr_watch ++] = (GDBWatch){ .addr = addr, .len = len };
+      } else if (!insert && i < nr_watch) {
+        watch[i] = watch[-- nr_watch];
+      }
+      break;
+    default: send_reply(""); return; // read and access watchpoints are not supported
+  }
+  send_reply("OK");
+}
+
+static void report_stop() {
+  switch (nemu_state.state) {
+    case NEMU_END:
+      snprintf(reply, sizeof(reply), "W%02x", nemu_state.halt_ret & 0xff);
+      break;
+    case NEMU_ABORT: strcpy(reply, "X06"); break;
+    default:
+      if (stop_reason == STOP_WATCH) {
+        snprintf(reply, sizeof(reply), "T05watch:" FMT_WORD ";", (word_t)watch_hit_addr);
+      } else {
+        strcpy(reply, stop_reason == STOP_INTR ? "S02" : "S05");
+      }
+  }
+  send_reply(reply);
+}
+
+static void resume(bool step, bool range, vaddr_t start, vaddr_t end) {
+  range_step = range;
+  range_start = start;
+  range_end = end;
+  stop_reason = STOP_NONE;
+  watch_hit = false;
+  cpu_exec(step ? 1 : -1);
+  range_step = false;
+  report_stop();
+}
+
+// only the first action is taken since NEMU has a single thread
+static void handle_vcont(const char *args) {
+  if (args[0] == '?') { send_reply("vCont;c;C;s;S;r"); return; }
+  if (args[0] != ';') { send_reply(""); return; }
+  char *end;
+  switch (args[1]) {
+    case 'c': case 'C': resume(false, false, 0, 0); break;
+    case 's': case 'S': resume(true, false, 0, 0); break;
+    case 'r': {
+      vaddr_t start = strtoull(args + 2, &end, 16);
+      vaddr_t stop = strtoull(end + 1, NULL, 16);
+      resume(false, true, start, stop);
+      break;
+    }
+    default: send_reply(""); break;
+  }
+}
+
+static bool has_prefix(const char *str, const char *prefix) {
+  return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+static void handle_query(const char *pkt) {
+  if (has_prefix(pkt, "qSupported")) {
+    snprintf(reply, sizeof(reply), "PacketSize=%x;vContSupported+", PACKET_SIZE);
+    send_reply(reply);
+  }
+  else if (has_prefix(pkt, "qAttached")) send_reply("1");
+  else if (has_prefix(pkt, "qfThreadInfo")) send_reply("m1");
+  else if (has_prefix(pkt, "qsThreadInfo")) send_reply("l");
+  else if (has_prefix(pkt, "qC")) send_reply("QC1");
+  else send_reply("");
+}
+
+/* Return false when the session is over. */
+static bool handle_packet(char *pkt) {
+  switch (pkt[0]) {
+    case '?': report_stop(); break;
+    case 'g': read_regs(); break;
+    case 'G': write_regs(pkt + 1); break;
+    case 'p': read_reg(pkt + 1); break;
+    case 'P': write_reg(pkt + 1); break;
+    case 'm': read_mem(pkt + 1); break;
+    case 'M': write_mem(pkt + 1); break;
+    case 'Z': set_point(pkt + 1, true); break;
+    case 'z': set_point(pkt + 1, false); break;
+    case 'c': case 's':
+      if (pkt[1] != '\0') cpu.pc = strtoull(pkt + 1, NULL, 16);
+      resume(pkt[0] == 's', false, 0, 0);
+      break;
+    case 'H': case 'T': send_reply("OK"); break;
+    case 'q': handle_query(pkt); break;
+    case 'v':
+      if (has_prefix(pkt, "vCont")) handle_vcont(pkt + 5);
+      else if (has_prefix(pkt, "vKill")) { send_reply("OK"); nemu_state.state = NEMU_QUIT; return false; }
+      else send_reply("");
+      break;
+    case 'D': send_reply("OK"); return false;
+    case 'k': nemu_state.state = NEMU_QUIT; return false;
+    default: send_reply(""); break;
+  }
+  return nemu_state.state != NEMU_END && nemu_state.state != NEMU_ABORT;
+}
+
+/* Return false if no GDB address is given, and sdb should be used instead. */
+bool gdbstub_mainloop() {
+  if (gdb_addr == NULL) return false;
+
+  bool is_port = gdb_addr[strspn(gdb_addr, "0123456789")] == '\0';
+  Log("Waiting for GDB to connect to %s%s", is_port ? "localhost:" : "", gdb_addr);
+  conn = is_port ? gdb_begin_server_inet(atoi(gdb_addr)) : gdb_begin_server_unix(gdb_addr);
+  Log("GDB connected");
+
+  bool running = true;
+  while (running) {
+    size_t size;
+    char *pkt = (char *)gdb_recv(conn, &size);
+    running = handle_packet(pkt);
+    free(pkt);
+  }
+
+  gdb_end(conn);
+  conn = NULL;
+
+  if (nemu_state.state == NEMU_STOP || nemu_state.state == NEMU_RUNNING) {
+    // detached, let the guest run to the end
+    nr_bp = nr_watch = 0;
+    cpu_exec(-1);
+  }
+  return true;
+}
+#endif
@@ -15,6 +15,7 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
+#include <memory/vaddr.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "sdb.h"
@@ -23,6 +24,7 @@ static int is_batch_mode = false;
 
 void init_regex();
 void init_wp_pool();
+bool gdbstub_mainloop();
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char* rl_gets() {
@@ -57,6 +59,18 @@ static int cmd_help(char *args);
 static int cmd_s(char *args);
 static int cmd_info(char *args);
 static int cmd_x(char *args);
+#ifdef CONFIG_CHECKPOINT
+static int cmd_save(char *args);
+static int cmd_load(char *args);
+#endif
+#ifdef CONFIG_SNAPSHOT
+static int cmd_rsi(char *args);
+static int cmd_rc(char *args);
+#endif
+#ifdef CONFIG_DIFFTEST
+static int cmd_detach(char *args);
+static int cmd_attach(char *args);
+#endif
 static struct {
   const char *name;
   const char *description;
@@ -72,6 +86,18 @@ static struct {
 info w: print the information of watchpoint\n",cmd_info},
   {"x","x N EXPR:Scan the memory",cmd_x},
   {"p","p EXPR:Print the value of the expression",NULL},
+#ifdef CONFIG_CHECKPOINT
+  { "save", "save FILE: Save a checkpoint of the machine state to FILE", cmd_save },
+  { "load", "load FILE: Restore the machine state from the checkpoint FILE", cmd_load },
+#endif
+#ifdef CONFIG_SNAPSHOT
+  { "rsi", "rsi [N]: Step back N instructions, 1 by default", cmd_rsi },
+  { "rc", "rc ADDR: Go back to the last write to the word at ADDR", cmd_rc },
+#endif
+#ifdef CONFIG_DIFFTEST
+  { "detach", "Stop differential testing, and let DUT run alone", cmd_detach },
+  { "attach", "Copy the machine state to REF, and restart differential testing", cmd_attach },
+#endif
   
 };
 
@@ -160,16 +186,96 @@ static int cmd_x(char *args){
 
 }
 
+#ifdef CONFIG_CHECKPOINT
+bool checkpoint_save(const char *file);
+bool checkpoint_restore(const char *file);
+void snapshot_reset();
+
+static int cmd_save(char *args) {
+  char *arg = strtok(NULL, " ");
+  if (arg == NULL) { printf("save FILE: Save a checkpoint of the machine state to FILE\n"); }
+  else { checkpoint_save(arg); }
+  return 0;
+}
+
+static int cmd_load(char *args) {
+  char *arg = strtok(NULL, " ");
+  if (arg == NULL) { printf("load FILE: Restore the machine state from the checkpoint FILE\n"); }
+  else if (checkpoint_restore(arg)) { IFDEF(CONFIG_SNAPSHOT, snapshot_reset()); }
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_SNAPSHOT
+#include <setjmp.h>
+
+extern sigjmp_buf snapshot_jmp;
+void init_snapshot();
+void snapshot_resumed();
+void snapshot_rewind(uint64_t target);
+void snapshot_rewind_write(paddr_t addr, int len);
+
+static int cmd_rsi(char *args) {
+  char *arg = strtok(NULL, " ");
+  uint64_t n = 1;
+  if (arg != NULL && (sscanf(arg, "%" SCNu64, &n) != 1 || n == 0)) {
+    printf("Invalid argument\n");
+    return 0;
+  }
+  snapshot_rewind(n < g_nr_guest_inst ? g_nr_guest_inst - n : 0);
+  return 0;
+}
+
+static int cmd_rc(char *args) {
+  char *arg = strtok(NULL, " ");
+  char *end = NULL;
+  paddr_t addr = (arg == NULL ? 0 : strtoul(arg, &end, 0));
+  if (arg == NULL || *end != '\0') {
+    printf("rc ADDR: Go back to the last write to the word at ADDR\n");
+    return 0;
+  }
+  snapshot_rewind_write(addr, sizeof(word_t));
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST
+#include <cpu/difftest.h>
+
+static int cmd_detach(char *args) {
+  difftest_detach();
+  printf("Differential testing is detached at pc = " FMT_WORD "\n", cpu.pc);
+  return 0;
+}
+
+static int cmd_attach(char *args) {
+  difftest_attach();
+  printf("Differential testing is attached at pc = " FMT_WORD "\n", cpu.pc);
+  return 0;
+}
+#endif
+
 void sdb_set_batch_mode() {
   is_batch_mode = true;
 }
 
 void sdb_mainloop() {
+#ifdef CONFIG_GDBSTUB
+  // the GDB stub takes over even in batch mode
+  if (gdbstub_mainloop()) return;
+#endif
+
   if (is_batch_mode) {
     cmd_c(NULL);
     return;
   }
 
+#ifdef CONFIG_SNAPSHOT
+  // a process resumed from a snapshot starts over here
+  if (sigsetjmp(snapshot_jmp, 1) == 0) init_snapshot();
+  else snapshot_resumed();
+#endif
+
   for (char *str; (str = rl_gets()) != NULL; ) {
     char *str_end = str + strlen(str);
 
@@ -0,0 +1,240 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+
+#ifdef CONFIG_SNAPSHOT
+#include <setjmp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Reverse execution with fork()-based snapshots.
+ * Every CONFIG_SNAPSHOT_INTERVAL instructions, NEMU forks a child, which
+ * keeps the machine state of that point for free: pmem, `cpu', the devices
+ * and a REF loaded as a shared object are all copied on write. The child
+ * sleeps on its command pipe until it is
+ *   - resumed: it replays to the target instruction and takes over sdb,
+ *     while the process resuming it retires;
+ *   - asked to scan: a throwaway child replays to the given instruction and
+ *     reports the last write to the watched location, and it keeps sleeping;
+ *   - asked to quit, or every write end of the pipe is closed.
+ * A snapshot only knows the snapshots taken before it, which are exactly the
+ * ones still valid after rewinding to it. The process NEMU is started as is
+ * waited by the shell, so it stays after retiring, and exits with the status
+ * of the last active process.
+ * The replay is deterministic unless the guest reads the host time or input.
+ */
+
+enum { SNAP_RESUME, SNAP_SCAN, SNAP_QUIT };
+
+#define SCAN_NONE UINT64_MAX
+#define SCAN_FAIL (UINT64_MAX - 1)
+
+typedef struct {
+  int type;
+  uint64_t target; // RESUME: the instruction to stop before; SCAN: the end of the replay
+  paddr_t addr;    // the watched location, valid if `len' is not zero
+  int len;
+} SnapCmd;
+
+typedef struct {
+  uint64_t inst;
+  int fd; // the write end of the command pipe
+} Snapshot;
+
+sigjmp_buf snapshot_jmp;
+uint64_t g_snap_next_inst = UINT64_MAX;
+int g_snap_watch_len = 0;
+
+static Snapshot snap[CONFIG_SNAPSHOT_NR];
+static int nr_snap = 0;
+static bool is_root = true;
+static int done_pipe[2] = { -1, -1 }; // the exit status of the last active process
+static int scan_pipe[2] = { -1, -1 }; // the results of scans
+static SnapCmd pending = {};
+static paddr_t watch_addr = 0;
+static uint64_t watch_last = SCAN_NONE;
+
+void snapshot_watch_write(paddr_t addr, int len) {
+  if (addr < watch_addr + g_snap_watch_len && watch_addr < addr + len) {
+    watch_last = g_nr_guest_inst;
+  }
+}
+
+static void update_next_inst() {
+  g_snap_next_inst = (g_nr_guest_inst / CONFIG_SNAPSHOT_INTERVAL + 1) * CONFIG_SNAPSHOT_INTERVAL;
+}
+
+static bool send_cmd(int i, SnapCmd *cmd) {
+  return write(snap[i].fd, cmd, sizeof(*cmd)) == sizeof(*cmd);
+}
+
+static void drop(int i) {
+  SnapCmd cmd = { .type = SNAP_QUIT };
+  send_cmd(i, &cmd);
+  close(snap[i].fd);
+  memmove(&snap[i], &snap[i + 1], sizeof(snap[0]) * (nr_snap - i - 1));
+  nr_snap --;
+}
+
+static void snapshot_wait(int fd) {
+  SnapCmd cmd;
+  while (true) {
+    if (read(fd, &cmd, sizeof(cmd)) != sizeof(cmd) || cmd.type == SNAP_QUIT) _exit(0);
+    if (cmd.type == SNAP_RESUME) break;
+
+    // replay in a child, and keep this snapshot
+    pid_t pid = fork();
+    if (pid == 0) break;
+    int status = 1;
+    if (pid > 0) waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      uint64_t fail = SCAN_FAIL;
+      write(scan_pipe[1], &fail, sizeof(fail));
+    }
+  }
+  close(fd);
+  pending = cmd;
+  siglongjmp(snapshot_jmp, 1);
+}
+
+static void snapshot_take() {
+  if (nr_snap == CONFIG_SNAPSHOT_NR) drop(0);
+
+  int fd[2];
+  if (pipe(fd) != 0) {
+    Log("Can not take a snapshot at instruction %" PRIu64, g_nr_guest_inst);
+    return;
+  }
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    is_root = false;
+    close(fd[1]);
+    snapshot_wait(fd[0]);
+  }
+  close(fd[0]);
+  if (pid < 0) {
+    close(fd[1]);
+    Log("Can not take a snapshot at instruction %" PRIu64, g_nr_guest_inst);
+    return;
+  }
+  snap[nr_snap ++] = (Snapshot) { .inst = g_nr_guest_inst, .fd = fd[1] };
+}
+
+void snapshot_periodic() {
+  snapshot_take();
+  update_next_inst();
+}
+
+// let the i-th snapshot take over, and retire
+static void resume(int i, uint64_t target, paddr_t addr, int len) {
+  SnapCmd cmd = { .type = SNAP_RESUME, .target = target, .addr = addr, .len = len };
+  fflush(NULL);
+  if (!send_cmd(i, &cmd)) {
+    printf("The snapshot at instruction %" PRIu64 " is lost\n", snap[i].inst);
+    drop(i);
+    return;
+  }
+  // the later snapshots belong to the abandoned future
+  while (nr_snap > i + 1) drop(nr_snap - 1);
+  if (!is_root) _exit(0);
+
+  for (int j = 0; j < nr_snap; j ++) close(snap[j].fd);
+  close(done_pipe[1]);
+  int status = 1;
+  read(done_pipe[0], &status, sizeof(status));
+  _exit(status);
+}
+
+void snapshot_rewind(uint64_t target) {
+  int i = nr_snap - 1;
+  while (i >= 0 && snap[i].inst > target) i --;
+  if (i < 0) {
+    printf("No snapshot is taken before instruction %" PRIu64 "\n", target);
+    return;
+  }
+  resume(i, target, 0, 0);
+}
+
+/* Scan backward from the latest snapshot for the last write to [addr, addr + len),
+ * and rewind to the instruction making it. */
+void snapshot_rewind_write(paddr_t addr, int len) {
+  uint64_t end = g_nr_guest_inst;
+  for (int i = nr_snap - 1; i >= 0; i --) {
+    if (snap[i].inst >= end) continue;
+    SnapCmd cmd = { .type = SNAP_SCAN, .target = end, .addr = addr, .len = len };
+    uint64_t last = SCAN_FAIL;
+    if (send_cmd(i, &cmd)) read(scan_pipe[0], &last, sizeof(last));
+    if (last == SCAN_FAIL) {
+      printf("Can not replay from the snapshot at instruction %" PRIu64 "\n", snap[i].inst);
+      return;
+    }
+    if (last != SCAN_NONE) {
+      resume(i, last, addr, len);
+      return;
+    }
+    end = snap[i].inst;
+  }
+  printf("No write to " FMT_PADDR " since instruction %" PRIu64 "\n", addr, end);
+}
+
+// called in a process resumed from a snapshot, on the stack of `sdb_mainloop()'
+void snapshot_resumed() {
+  if (nemu_state.state == NEMU_RUNNING) nemu_state.state = NEMU_STOP;
+
+  if (pending.type == SNAP_SCAN) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) dup2(null, STDOUT_FILENO);
+    g_snap_next_inst = UINT64_MAX;
+    watch_addr = pending.addr;
+    watch_last = SCAN_NONE;
+    g_snap_watch_len = pending.len;
+    cpu_exec(pending.target - g_nr_guest_inst);
+    write(scan_pipe[1], &watch_last, sizeof(watch_last));
+    _exit(0);
+  }
+
+  // keep this point, since this snapshot is used up
+  snapshot_periodic();
+  if (pending.target > g_nr_guest_inst) cpu_exec(pending.target - g_nr_guest_inst);
+  printf("Rewound to instruction %" PRIu64 ", pc = " FMT_WORD "\n", g_nr_guest_inst, cpu.pc);
+  if (pending.len != 0) {
+    printf("The next instruction makes the last write to " FMT_PADDR "\n", pending.addr);
+  }
+}
+
+// the snapshots of another timeline are useless, e.g. after loading a checkpoint
+void snapshot_reset() {
+  while (nr_snap > 0) drop(nr_snap - 1);
+  snapshot_periodic();
+}
+
+static void snapshot_exit(int status, void *arg) {
+  if (!is_root) write(done_pipe[1], &status, sizeof(status));
+}
+
+void init_snapshot() {
+  Assert(pipe(done_pipe) == 0 && pipe(scan_pipe) == 0, "Can not create pipes for snapshots");
+  signal(SIGPIPE, SIG_IGN); // a snapshot may have quitted
+  on_exit(snapshot_exit, NULL);
+  snapshot_periodic();
+  Log("Snapshots are taken every %d instructions, use `rsi' and `rc' to execute reversely",
+      CONFIG_SNAPSHOT_INTERVAL);
+}
+#endif
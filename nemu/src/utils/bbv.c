@@ -0,0 +1,143 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+
+#ifdef CONFIG_BBV
+/* Basic-block vectors for SimPoint. The instructions executed are counted
+ * per basic block, and one line is written for every interval:
+ *   T:id:count :id:count ...
+ * where `id' numbers the basic blocks from 1 by their first execution, and
+ * `count' is the number of instructions executed in the block, so the counts
+ * of a line add up to the length of the interval. An incomplete interval at
+ * the end is not written.
+ * A block ends at every instruction which does not fall through, so a branch
+ * not taken does not split blocks. This is enough to tell phases apart.
+ */
+
+typedef struct {
+  vaddr_t pc;
+  uint64_t count; // in the current interval
+} BB;
+
+static FILE *bbv_fp = NULL;
+static uint64_t bbv_interval = 0;
+static uint64_t bbv_next = 0;
+static uint64_t nr_interval = 0;
+
+static BB *bb = NULL;             // indexed by id
+static uint32_t nr_bb = 0, max_bb = 0;
+static uint32_t *bb_map = NULL;   // open addressing from pc to id, 0 for empty
+static uint32_t map_mask = 0;
+static uint32_t *touched = NULL;  // the ids counted in the current interval
+static uint32_t nr_touched = 0;
+
+static vaddr_t bb_start = 0;
+static uint64_t bb_len = 0;
+
+bool g_bbv_on = false;
+
+static inline uint32_t hash(vaddr_t pc) {
+  return ((uint64_t)pc * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static void map_insert(uint32_t id) {
+  uint32_t h = hash(bb[id].pc) & map_mask;
+  while (bb_map[h] != 0) h = (h + 1) & map_mask;
+  bb_map[h] = id;
+}
+
+static void grow() {
+  max_bb = (max_bb == 0 ? 4096 : max_bb * 2);
+  bb = realloc(bb, sizeof(bb[0]) * max_bb);
+  touched = realloc(touched, sizeof(touched[0]) * max_bb);
+  Assert(bb && touched, "Can not allocate basic-block vectors");
+  // keep the load factor of the map below 1/2
+  free(bb_map);
+  map_mask = max_bb * 2 - 1;
+  bb_map = calloc(map_mask + 1, sizeof(bb_map[0]));
+  Assert(bb_map, "Can not allocate basic-block vectors");
+  for (uint32_t id = 1; id <= nr_bb; id ++) map_insert(id);
+}
+
+static uint32_t bb_id(vaddr_t pc) {
+  uint32_t h = hash(pc) & map_mask;
+  for (; bb_map[h] != 0; h = (h + 1) & map_mask) {
+    if (bb[bb_map[h]].pc == pc) return bb_map[h];
+  }
+  if (nr_bb + 1 == max_bb) {
+    grow();
+    return bb_id(pc);
+  }
+  uint32_t id = ++ nr_bb;
+  bb[id] = (BB) { .pc = pc, .count = 0 };
+  bb_map[h] = id;
+  return id;
+}
+
+static void bb_end() {
+  if (bb_len == 0) return;
+  uint32_t id = bb_id(bb_start);
+  if (bb[id].count == 0) touched[nr_touched ++] = id;
+  bb[id].count += bb_len;
+  bb_len = 0;
+}
+
+static void dump() {
+  // the rest of the block is counted in the next interval
+  bb_end();
+  fputc('T', bbv_fp);
+  for (uint32_t i = 0; i < nr_touched; i ++) {
+    fprintf(bbv_fp, ":%u:%" PRIu64 " ", touched[i], bb[touched[i]].count);
+    bb[touched[i]].count = 0;
+  }
+  fputc('\n', bbv_fp);
+  nr_touched = 0;
+  nr_interval ++;
+  bbv_next += bbv_interval;
+}
+
+// called by cpu_exec() after every instruction
+void bbv_step(vaddr_t snpc, vaddr_t dnpc) {
+  bb_len ++;
+  if (dnpc != snpc) {
+    bb_end();
+    bb_start = dnpc;
+  }
+  if (g_nr_guest_inst == bbv_next) dump();
+}
+
+static void bbv_close() {
+  fclose(bbv_fp);
+  Log("%" PRIu64 " basic-block vectors of %u blocks are written", nr_interval, nr_bb);
+}
+
+/* The intervals start from the current instruction, e.g. the one restored
+ * from a checkpoint, and the k-th vector describes the instructions
+ * [k * interval, (k + 1) * interval) counted from it. */
+void init_bbv(const char *file, uint64_t interval, vaddr_t pc) {
+  if (file == NULL) return;
+  Assert(interval > 0, "The interval of basic-block vectors should not be 0");
+  bbv_fp = fopen(file, "w");
+  Assert(bbv_fp, "Can not open '%s'", file);
+  grow();
+  bbv_interval = interval;
+  bbv_next = g_nr_guest_inst + interval;
+  bb_start = pc;
+  g_bbv_on = true;
+  atexit(bbv_close);
+  Log("Basic-block vectors of every %" PRIu64 " instructions are written to %s", interval, file);
+}
+#endif
@@ -0,0 +1,500 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#include <device/map.h>
+#include <cpu/difftest.h>
+#include <cpu/event.h>
+
+#ifdef CONFIG_CHECKPOINT
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A checkpoint keeps the whole machine state in a file:
+ *   CkptHeader
+ *   the file name of the parent checkpoint, if it is incremental, which is
+ *   relative to the directory of this file or absolute
+ *   CPU_state
+ *   the I/O space allocated by new_space(), which holds the device registers
+ *   the internal state registered by devices, each led by a CkptState
+ *   uint32_t[]: the indices of the pages of pmem saved in this file
+ *   the pages, starting at a page boundary of the file
+ * A full checkpoint saves the non-zero pages. An incremental checkpoint only
+ * saves the pages written since the previous checkpoint, which becomes its
+ * parent, and pmem is rebuilt by applying the pages from the full checkpoint
+ * at the root of the chain down to it.
+ * On restore, the pages are mapped copy-on-write from the files into pmem,
+ * so they are only read when the guest touches them.
+ */
+#define CKPT_MAGIC 0x54504b43554d454eull // "NEMUCKPT"
+#define CKPT_VERSION 2
+#define CKPT_PAGE_SHIFT 12
+#define CKPT_PAGE_SIZE (1ul << CKPT_PAGE_SHIFT)
+#define NR_CKPT_PAGE (CONFIG_MSIZE >> CKPT_PAGE_SHIFT)
+#define MAX_STATE 16
+#define MAX_DEPTH 256
+// each run of consecutive pages takes a mapping, fall back to copying beyond this
+#define MAX_MAP_RUN 4096
+
+static_assert(PMEM_PAGE_SIZE == CKPT_PAGE_SIZE, "page size of the dirty map should match checkpoints");
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t cpu_size;
+  uint64_t mbase;
+  uint64_t msize;
+  uint64_t io_size;
+  uint64_t nr_guest_inst;
+  uint64_t uptime;
+  uint32_t nr_state;
+  uint32_t nr_page;
+  uint32_t depth;      // length of the chain to the full checkpoint, 0 if it is full
+  uint32_t parent_len; // including the terminating '\0'
+} CkptHeader;
+
+typedef struct {
+  char name[24];
+  uint64_t size;
+} CkptState;
+
+// a checkpoint file mapped for restoring
+typedef struct {
+  int fd;
+  uint8_t *buf;
+  size_t size;
+  CkptHeader *h;
+  const char *parent;
+  size_t cpu_off, page_idx_off, page_off;
+  int slot[MAX_STATE]; // the registered state of each saved state, or -1
+} Ckpt;
+
+static struct {
+  const char *name;
+  void *ptr;
+  size_t size;
+  void (*restore)();
+} state[MAX_STATE];
+static int nr_state = 0;
+
+static uint32_t page_idx[NR_CKPT_PAGE];
+
+// the last checkpoint saved or restored, which is the parent of the next incremental one
+static char *last_file = NULL;
+static uint32_t last_depth = 0;
+
+static char *periodic_prefix = NULL;
+static uint64_t periodic_interval = 0;
+uint64_t g_ckpt_next_inst = UINT64_MAX;
+
+// the intervals chosen by SimPoint, in ascending order
+static uint64_t *simpoint = NULL;
+static int nr_simpoint = 0, simpoint_next = 0, simpoint_missed = 0;
+static uint64_t simpoint_interval = 0, simpoint_base = 0;
+
+void checkpoint_add_state(const char *name, void *ptr, size_t size, void (*restore)()) {
+  assert(nr_state < MAX_STATE);
+  assert(strlen(name) < sizeof(((CkptState *)0)->name));
+  state[nr_state ++] = (typeof(state[0])) { name, ptr, size, restore };
+}
+
+static inline uint8_t* pmem_page(uint32_t idx) {
+  return guest_to_host(CONFIG_MBASE + ((paddr_t)idx << CKPT_PAGE_SHIFT));
+}
+
+static bool page_is_zero(const uint8_t *p) {
+  const uint64_t *q = (const uint64_t *)p;
+  for (int i = 0; i < CKPT_PAGE_SIZE / sizeof(q[0]); i ++) {
+    if (q[i] != 0) return false;
+  }
+  return true;
+}
+
+// collect the pages written since the last checkpoint and clear their dirty bits
+static uint32_t collect_dirty_pages() {
+  paddr_t pages[256];
+  uint32_t nr_page = 0;
+  int nr;
+  while ((nr = pmem_dirty_scan(PMEM_DIRTY_CKPT, pages, ARRLEN(pages))) > 0) {
+    for (int i = 0; i < nr; i ++) page_idx[nr_page ++] = (pages[i] - CONFIG_MBASE) >> CKPT_PAGE_SHIFT;
+  }
+  return nr_page;
+}
+
+static void set_last(const char *file, uint32_t depth) {
+  free(last_file);
+  last_file = (file ? strdup(file) : NULL);
+  last_depth = depth;
+}
+
+// the name of `parent' saved in its child `file', see parent_file()
+static char* parent_name(const char *parent, const char *file) {
+  char *p = strdup(parent), *f = strdup(file);
+  char *name;
+  if (strcmp(dirname(p), dirname(f)) == 0) {
+    strcpy(p, parent);
+    name = strdup(basename(p));
+  } else {
+    name = realpath(parent, NULL);
+  }
+  free(p);
+  free(f);
+  return (name ? name : strdup(parent));
+}
+
+// the file of the parent checkpoint named `parent' in `file'
+static char* parent_file(const char *parent, const char *file) {
+  if (parent[0] == '/') return strdup(parent);
+  char *f = strdup(file);
+  const char *dir = dirname(f);
+  char *path = malloc(strlen(dir) + strlen(parent) + 2);
+  sprintf(path, "%s/%s", dir, parent);
+  free(f);
+  return path;
+}
+
+static bool save(const char *file, bool incremental) {
+  // write a new file and rename it, since the old one may be mapped into pmem
+  char tmp[strlen(file) + 8];
+  sprintf(tmp, "%s.tmp", file);
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    printf("Can not open '%s'\n", tmp);
+    return false;
+  }
+
+  char *parent = NULL;
+  uint32_t depth = 0, nr_page;
+  if (incremental && last_file != NULL && last_depth < CONFIG_CHECKPOINT_CHAIN) {
+    parent = parent_name(last_file, file);
+    depth = last_depth + 1;
+    nr_page = collect_dirty_pages();
+  } else {
+    collect_dirty_pages();
+    nr_page = 0;
+    for (uint32_t i = 0; i < NR_CKPT_PAGE; i ++) {
+      if (!page_is_zero(pmem_page(i))) page_idx[nr_page ++] = i;
+    }
+  }
+
+  size_t io_size;
+  uint8_t *io = io_space_used(&io_size);
+  CkptHeader h = { .magic = CKPT_MAGIC, .version = CKPT_VERSION, .cpu_size = sizeof(cpu),
+    .mbase = CONFIG_MBASE, .msize = CONFIG_MSIZE, .io_size = io_size,
+    .nr_guest_inst = g_nr_guest_inst, .uptime = get_time(),
+    .nr_state = nr_state, .nr_page = nr_page,
+    .depth = depth, .parent_len = (parent ? strlen(parent) + 1 : 0) };
+  fwrite(&h, sizeof(h), 1, fp);
+  if (parent) fwrite(parent, 1, h.parent_len, fp);
+  fwrite(&cpu, sizeof(cpu), 1, fp);
+  fwrite(io, 1, io_size, fp);
+  for (int i = 0; i < nr_state; i ++) {
+    CkptState s = { .size = state[i].size };
+    strcpy(s.name, state[i].name);
+    fwrite(&s, sizeof(s), 1, fp);
+    fwrite(state[i].ptr, 1, state[i].size, fp);
+  }
+  fwrite(page_idx, sizeof(page_idx[0]), nr_page, fp);
+
+  long off = ftell(fp);
+  fseek(fp, (off + CKPT_PAGE_SIZE - 1) & ~(CKPT_PAGE_SIZE - 1), SEEK_SET);
+  for (uint32_t i = 0; i < nr_page; i ++) {
+    fwrite(pmem_page(page_idx[i]), CKPT_PAGE_SIZE, 1, fp);
+  }
+
+  bool ok = !ferror(fp);
+  ok = (fclose(fp) == 0) && ok;
+  if (ok) ok = (rename(tmp, file) == 0);
+  if (!ok) {
+    printf("Can not write the checkpoint to '%s'\n", file);
+    unlink(tmp);
+    free(parent);
+    // the dirty pages are lost, the next checkpoint should be a full one
+    set_last(NULL, 0);
+    return false;
+  }
+  if (parent) Log("Checkpoint saved to %s, with %u pages written since %s", file, nr_page, last_file);
+  else Log("Checkpoint saved to %s, with %u non-zero pages of pmem", file, nr_page);
+  free(parent);
+  set_last(file, depth);
+  return true;
+}
+
+bool checkpoint_save(const char *file) {
+  return save(file, false);
+}
+
+static inline uint64_t simpoint_inst(int i) {
+  return simpoint_base + simpoint[i] * simpoint_interval;
+}
+
+static void update_next_inst() {
+  g_ckpt_next_inst = (periodic_interval == 0 ? UINT64_MAX :
+      (g_nr_guest_inst / periodic_interval + 1) * periodic_interval);
+  if (simpoint_next < nr_simpoint && simpoint_inst(simpoint_next) < g_ckpt_next_inst) {
+    g_ckpt_next_inst = simpoint_inst(simpoint_next);
+  }
+}
+
+// take a full checkpoint at the start of each interval chosen by SimPoint
+static void take_simpoint() {
+  if (simpoint_next == nr_simpoint) return;
+  for (; simpoint_next < nr_simpoint && simpoint_inst(simpoint_next) <= g_nr_guest_inst; simpoint_next ++) {
+    if (simpoint_inst(simpoint_next) < g_nr_guest_inst) {
+      // e.g. it is before the checkpoint restored
+      Log("The start of SimPoint interval %" PRIu64 " has passed, no checkpoint is taken", simpoint[simpoint_next]);
+      simpoint_missed ++;
+      continue;
+    }
+    char file[strlen(periodic_prefix) + 32];
+    sprintf(file, "%s.sp%" PRIu64, periodic_prefix, simpoint[simpoint_next]);
+    save(file, false);
+  }
+  if (simpoint_next == nr_simpoint) {
+    if (simpoint_missed == 0) Log("All %d SimPoint checkpoints are taken", nr_simpoint);
+    else Log("%d of %d SimPoint checkpoints are taken, %d are missed", nr_simpoint - simpoint_missed,
+        nr_simpoint, simpoint_missed);
+    nemu_state.state = NEMU_QUIT;
+  }
+}
+
+// called by cpu_exec() when `g_nr_guest_inst' reaches `g_ckpt_next_inst'
+void checkpoint_periodic() {
+  take_simpoint();
+  if (periodic_interval != 0 && g_nr_guest_inst % periodic_interval == 0) {
+    char file[strlen(periodic_prefix) + 32];
+    sprintf(file, "%s.%" PRIu64, periodic_prefix, g_nr_guest_inst);
+    save(file, true);
+  }
+  update_next_inst();
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Read the intervals chosen by SimPoint from `file', where each line is
+ *   interval_index cluster_id
+ * as written by tools/simpoint, and take a checkpoint named `prefix'.spK
+ * at the start of the K-th interval. NEMU quits after the last one. */
+void checkpoint_set_simpoint(const char *file, uint64_t interval) {
+  FILE *fp = fopen(file, "r");
+  Assert(fp, "Can not open '%s'", file);
+  Assert(interval > 0, "The interval of SimPoint should not be 0");
+  uint64_t idx;
+  int max = 0;
+  while (fscanf(fp, "%" SCNu64 " %*d", &idx) == 1) {
+    if (nr_simpoint == max) {
+      max = (max == 0 ? 64 : max * 2);
+      simpoint = realloc(simpoint, sizeof(simpoint[0]) * max);
+      assert(simpoint);
+    }
+    simpoint[nr_simpoint ++] = idx;
+  }
+  fclose(fp);
+  Assert(nr_simpoint > 0, "No interval is found in '%s'", file);
+  qsort(simpoint, nr_simpoint, sizeof(simpoint[0]), cmp_u64);
+  simpoint_interval = interval;
+}
+
+static void ckpt_close(Ckpt *c) {
+  if (c->buf != MAP_FAILED) munmap(c->buf, c->size);
+  close(c->fd);
+}
+
+static uint32_t ckpt_page_idx(Ckpt *c, uint32_t i) {
+  uint32_t idx;
+  memcpy(&idx, c->buf + c->page_idx_off + sizeof(idx) * i, sizeof(idx));
+  return idx;
+}
+
+// map the file and check its layout, return an error message on failure
+static const char* ckpt_open(const char *file, Ckpt *c) {
+  c->fd = open(file, O_RDONLY);
+  if (c->fd < 0) return "can not open it";
+  struct stat st;
+  fstat(c->fd, &st);
+  c->size = st.st_size;
+  c->buf = (c->size >= sizeof(CkptHeader) ?
+      mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, c->fd, 0) : MAP_FAILED);
+  if (c->buf == MAP_FAILED) { close(c->fd); return "it is not a checkpoint"; }
+
+  CkptHeader *h = c->h = (CkptHeader *)c->buf;
+  size_t io_size;
+  io_space_used(&io_size);
+  const char *why = NULL;
+  if (h->magic != CKPT_MAGIC || h->version != CKPT_VERSION) why = "it is not a checkpoint of this version";
+  else if (h->cpu_size != sizeof(cpu) || h->mbase != CONFIG_MBASE || h->msize != CONFIG_MSIZE ||
+      h->io_size != io_size || h->nr_state > MAX_STATE || h->nr_page > NR_CKPT_PAGE) {
+    why = "it is taken with a different configuration";
+  }
+
+  size_t off = sizeof(*h);
+  c->parent = (const char *)(c->buf + off);
+  off += h->parent_len;
+  if (why == NULL && (off > c->size || (h->depth > 0) != (h->parent_len > 0) ||
+        (h->parent_len > 0 && c->parent[h->parent_len - 1] != '\0'))) {
+    why = "it is corrupted";
+  }
+  c->cpu_off = off;
+  off += sizeof(cpu) + io_size;
+  for (int i = 0; why == NULL && i < h->nr_state; i ++) {
+    CkptState *s = (CkptState *)(c->buf + off);
+    if (off + sizeof(*s) > c->size || off + sizeof(*s) + s->size > c->size) { why = "it is truncated"; break; }
+    c->slot[i] = -1;
+    for (int j = 0; j < nr_state; j ++) {
+      if (strncmp(s->name, state[j].name, sizeof(s->name)) == 0) {
+        if (s->size != state[j].size) why = "it is taken with a different configuration";
+        c->slot[i] = j;
+      }
+    }
+    off += sizeof(*s) + s->size;
+  }
+  c->page_idx_off = off;
+  off += sizeof(uint32_t) * h->nr_page;
+  c->page_off = (off + CKPT_PAGE_SIZE - 1) & ~(CKPT_PAGE_SIZE - 1);
+  if (why == NULL && (off > c->size || c->page_off + ((size_t)h->nr_page << CKPT_PAGE_SHIFT) > c->size)) {
+    why = "it is truncated";
+  }
+  for (uint32_t i = 0; why == NULL && i < h->nr_page; i ++) {
+    if (ckpt_page_idx(c, i) >= NR_CKPT_PAGE) why = "it is corrupted";
+  }
+  if (why != NULL) ckpt_close(c);
+  return why;
+}
+
+// apply the pages from the full checkpoint at `chain[n - 1]' to `chain[0]'
+static void restore_pmem(Ckpt *chain, int n) {
+  uint8_t *base = guest_to_host(CONFIG_MBASE);
+  int nr_run = 0;
+  for (int k = 0; k < n; k ++) {
+    for (uint32_t i = 0; i < chain[k].h->nr_page; i ++) {
+      if (i == 0 || ckpt_page_idx(&chain[k], i) != ckpt_page_idx(&chain[k], i - 1) + 1) nr_run ++;
+    }
+  }
+
+  if (((uintptr_t)base & (CKPT_PAGE_SIZE - 1)) != 0 || nr_run > MAX_MAP_RUN) {
+    memset(base, 0, CONFIG_MSIZE);
+    for (int k = n - 1; k >= 0; k --) {
+      Ckpt *c = &chain[k];
+      for (uint32_t i = 0; i < c->h->nr_page; i ++) {
+        memcpy(pmem_page(ckpt_page_idx(c, i)), c->buf + c->page_off + ((size_t)i << CKPT_PAGE_SHIFT),
+            CKPT_PAGE_SIZE);
+      }
+    }
+    return;
+  }
+
+  // drop the old content, then map each run of pages from the files
+  void *p = mmap(base, CONFIG_MSIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  Assert(p == base, "Can not remap pmem");
+  for (int k = n - 1; k >= 0; k --) {
+    Ckpt *c = &chain[k];
+    for (uint32_t i = 0, j; i < c->h->nr_page; i = j) {
+      uint32_t first = ckpt_page_idx(c, i);
+      for (j = i + 1; j < c->h->nr_page && ckpt_page_idx(c, j) == first + (j - i); j ++);
+      p = mmap(pmem_page(first), (size_t)(j - i) << CKPT_PAGE_SHIFT, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, c->fd, c->page_off + ((size_t)i << CKPT_PAGE_SHIFT));
+      Assert(p != MAP_FAILED, "Can not map the pages of the checkpoint into pmem");
+    }
+  }
+}
+
+bool checkpoint_restore(const char *file) {
+  // open the chain of checkpoints before changing anything
+  static Ckpt chain[MAX_DEPTH + 1];
+  int n = 0;
+  char *name = strdup(file);
+  const char *why = NULL;
+  while (true) {
+    why = ckpt_open(name, &chain[n]);
+    if (why != NULL) break;
+    n ++;
+    if (chain[n - 1].h->depth == 0) break;
+    if (n > MAX_DEPTH) { why = "the chain of checkpoints is too long"; break; }
+    char *parent = parent_file(chain[n - 1].parent, name);
+    free(name);
+    name = parent;
+  }
+  if (why != NULL) {
+    printf("Can not restore from '%s': %s\n", name, why);
+    free(name);
+    for (int k = 0; k < n; k ++) ckpt_close(&chain[k]);
+    return false;
+  }
+  free(name);
+
+  Ckpt *c = &chain[0];
+  size_t io_size;
+  uint8_t *io = io_space_used(&io_size);
+  size_t off = c->cpu_off;
+  memcpy(&cpu, c->buf + off, sizeof(cpu));
+  off += sizeof(cpu);
+  memcpy(io, c->buf + off, io_size);
+  off += io_size;
+  for (int i = 0; i < c->h->nr_state; i ++) {
+    CkptState *s = (CkptState *)(c->buf + off);
+    if (c->slot[i] >= 0) memcpy(state[c->slot[i]].ptr, s + 1, s->size);
+    else Log("Ignore the state '%.*s' in the checkpoint", (int)sizeof(s->name), s->name);
+    off += sizeof(*s) + s->size;
+  }
+  restore_pmem(chain, n);
+  // pmem is replaced as a whole without paddr_write()
+  pmem_dirty_range(CONFIG_MBASE, CONFIG_MSIZE);
+  collect_dirty_pages();
+
+  uint64_t old_nr_inst = g_nr_guest_inst;
+  g_nr_guest_inst = c->h->nr_guest_inst;
+  event_rebase(old_nr_inst);
+  set_time(c->h->uptime);
+  for (int i = 0; i < nr_state; i ++) {
+    if (state[i].restore) state[i].restore();
+  }
+  nemu_state.state = NEMU_STOP;
+  set_last(file, c->h->depth);
+  update_next_inst();
+
+  if (n > 1) Log("Checkpoint restored from %s and %d checkpoints it is chained to, pc = " FMT_WORD, file, n - 1, cpu.pc);
+  else Log("Checkpoint restored from %s, pc = " FMT_WORD, file, cpu.pc);
+  for (int k = 0; k < n; k ++) ckpt_close(&chain[k]);
+
+  difftest_attach();
+  return true;
+}
+
+/* Take a checkpoint named `prefix'.N when the number of instructions N is
+ * a multiple of `interval'. Each one is incremental to the previous one,
+ * until the chain reaches CONFIG_CHECKPOINT_CHAIN and a full one is taken. */
+void init_checkpoint(char *prefix, uint64_t interval) {
+  periodic_prefix = prefix;
+  periodic_interval = interval;
+  if (nr_simpoint > 0) {
+    // the intervals are counted from here, as the vectors of `--bbv' are
+    simpoint_base = g_nr_guest_inst;
+    Log("%d SimPoint checkpoints are taken to %s.spK, at the start of the K-th interval "
+        "of %" PRIu64 " instructions", nr_simpoint, prefix, simpoint_interval);
+    take_simpoint();
+  }
+  update_next_inst();
+  if (interval > 0) Log("Checkpoints are taken to %s.N every %" PRIu64 " instructions", prefix, interval);
+}
+#endif
@@ -13,9 +13,7 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
-#include <common.h>
-
-extern uint64_t g_nr_guest_inst;
+#include <cpu/cpu.h>
 
 #ifndef CONFIG_TARGET_AM
 FILE *log_fp = NULL;
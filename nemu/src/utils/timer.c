@@ -13,7 +13,7 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
-#include <common.h>
+#include <cpu/cpu.h>
 #include MUXDEF(CONFIG_TIMER_GETTIMEOFDAY, <sys/time.h>, <time.h>)
 
 IFDEF(CONFIG_TIMER_CLOCK_GETTIME,
@@ -38,12 +38,47 @@ static uint64_t get_time_internal() {
   return us;
 }
 
-uint64_t get_time() {
+// the time spent by NEMU itself
+uint64_t get_host_time() {
   if (boot_time == 0) boot_time = get_time_internal();
   uint64_t now = get_time_internal();
   return now - boot_time;
 }
 
+#ifdef CONFIG_VIRTUAL_TIME
+/* The guest time advances by CONFIG_VIRTUAL_TIME_CPI cycles per instruction
+ * at CONFIG_VIRTUAL_TIME_MHZ, so it does not depend on the host. */
+static uint64_t virtual_base = 0;
+static uint64_t nr_skipped_inst = 0;
+
+static inline uint64_t inst_to_us(uint64_t nr_inst) {
+  return nr_inst * CONFIG_VIRTUAL_TIME_CPI / CONFIG_VIRTUAL_TIME_MHZ;
+}
+
+// let the guest time jump forward by `nr_inst' instructions, e.g. when the guest is idle
+void virtual_time_skip(uint64_t nr_inst) {
+  nr_skipped_inst += nr_inst;
+}
+#endif
+
+// the uptime of the guest
+uint64_t get_time() {
+#ifdef CONFIG_VIRTUAL_TIME
+  return virtual_base + inst_to_us(g_nr_guest_inst + nr_skipped_inst);
+#else
+  return get_host_time();
+#endif
+}
+
+// let get_time() continue from `us', e.g. after restoring a checkpoint
+void set_time(uint64_t us) {
+#ifdef CONFIG_VIRTUAL_TIME
+  virtual_base = us - inst_to_us(g_nr_guest_inst + nr_skipped_inst);
+#else
+  boot_time = get_time_internal() - us;
+#endif
+}
+
 void init_rand() {
   srand(get_time_internal());
 }
@@ -19,51 +19,155 @@
 #include <time.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 // this should be enough
 static char buf[65536] = {};
-static char code_buf[65536 + 128] = {}; // a little larger than `buf`
-static char *code_format =
+static char code_buf[65536 * 3] = {}; // the C version of `buf', with divisions as `d(a,b)'
+static char *buf_p = NULL, *code_p = NULL;
+
+/* All expressions of a shard are evaluated by a single program, where
+ * division by zero marks the expression as bad instead of crashing.
+ */
+static char *code_head =
 "#include <stdio.h>\n"
-"int main() { "
-"  unsigned result = %s; "
-"  printf(\"%%u\", result); "
-"  return 0; "
-"}";
+"static int bad;\n"
+"static unsigned d(unsigned a, unsigned b) { if (b == 0) { bad = 1; return 0; } return a / b; }\n"
+"int main() {\n"
+"  unsigned result;\n";
+static char *code_expr =
+"  bad = 0; result = %s; if (bad) puts(\"-\"); else printf(\"%%u\\n\", result);\n";
+static char *code_tail =
+"  return 0;\n"
+"}\n";
+
+#define MAX_LEN 1024
+
+static int choose(int n) {
+  return rand() % n;
+}
+
+static void gen_str(const char *plain, const char *code) {
+  buf_p += sprintf(buf_p, "%s", plain);
+  code_p += sprintf(code_p, "%s", code);
+}
+
+static void gen_space() {
+  if (choose(4) == 0) gen_str(" ", "");
+}
+
+static void gen_num() {
+  char plain[16], code[16];
+  unsigned v = (choose(4) == 0 ? (unsigned)rand() : (unsigned)choose(100));
+  sprintf(plain, "%u", v);
+  sprintf(code, "%uu", v);
+  gen_str(plain, code);
+}
+
+static void gen_expr(int depth) {
+  if (depth > 8 || buf_p - buf > MAX_LEN) { gen_num(); return; }
+  switch (choose(3)) {
+    case 0: gen_num(); break;
+    case 1: gen_str("(", "("); gen_expr(depth + 1); gen_str(")", ")"); break;
+    default: {
+      char op = "+-*/"[choose(4)];
+      char op_str[2] = { op, '\0' };
+      // `d(a,b)' binds like a primary expression, so does `((a)/(b))'
+      if (op == '/') gen_str("((", "d(");
+      gen_space(); gen_expr(depth + 1); gen_space();
+      gen_str(op == '/' ? ")/(" : op_str, op == '/' ? "," : op_str);
+      gen_space(); gen_expr(depth + 1); gen_space();
+      if (op == '/') gen_str("))", ")");
+    }
+  }
+}
 
 static void gen_rand_expr() {
-  buf[0] = '\0';
+  buf_p = buf;
+  code_p = code_buf;
+  buf[0] = code_buf[0] = '\0';
+  gen_expr(0);
+}
+
+// generate `n' expressions and write them with their values to `out'
+static void run_shard(int n, FILE *out) {
+  char code_file[64], exe_file[64], cmd[256];
+  sprintf(code_file, "/tmp/.code-%d.c", getpid());
+  sprintf(exe_file, "/tmp/.expr-%d", getpid());
+
+  char **exprs = malloc(sizeof(exprs[0]) * n);
+  assert(exprs != NULL);
+  FILE *fp = fopen(code_file, "w");
+  assert(fp != NULL);
+  fputs(code_head, fp);
+  for (int i = 0; i < n; i ++) {
+    gen_rand_expr();
+    exprs[i] = strdup(buf);
+    fprintf(fp, code_expr, code_buf);
+  }
+  fputs(code_tail, fp);
+  fclose(fp);
+
+  sprintf(cmd, "gcc -O0 -w %s -o %s", code_file, exe_file);
+  int ret = system(cmd);
+  unlink(code_file);
+  if (ret != 0) return;
+
+  fp = popen(exe_file, "r");
+  assert(fp != NULL);
+  char line[32];
+  for (int i = 0; i < n && fgets(line, sizeof(line), fp) != NULL; i ++) {
+    if (line[0] != '-') fprintf(out, "%u %s\n", (unsigned)strtoul(line, NULL, 10), exprs[i]);
+    free(exprs[i]);
+  }
+  pclose(fp);
+  unlink(exe_file);
+  free(exprs);
 }
 
 int main(int argc, char *argv[]) {
   int seed = time(0);
-  srand(seed);
-  int loop = 1;
+  int loop = 1, shard = 1;
   if (argc > 1) {
     sscanf(argv[1], "%d", &loop);
   }
-  int i;
-  for (i = 0; i < loop; i ++) {
-    gen_rand_expr();
-
-    sprintf(code_buf, code_format, buf);
-
-    FILE *fp = fopen("/tmp/.code.c", "w");
-    assert(fp != NULL);
-    fputs(code_buf, fp);
-    fclose(fp);
-
-    int ret = system("gcc /tmp/.code.c -o /tmp/.expr");
-    if (ret != 0) continue;
+  if (argc > 2) {
+    sscanf(argv[2], "%d", &shard);
+    if (shard < 1) shard = 1;
+  }
 
-    fp = popen("/tmp/.expr", "r");
-    assert(fp != NULL);
+  if (shard == 1) {
+    srand(seed);
+    run_shard(loop, stdout);
+    return 0;
+  }
 
-    int result;
-    ret = fscanf(fp, "%d", &result);
-    pclose(fp);
+  // each shard is generated in a child process, the results are output in order
+  char out_file[shard][64];
+  for (int k = 0; k < shard; k ++) {
+    sprintf(out_file[k], "/tmp/.expr-out-%d-%d", getpid(), k);
+    int n = loop / shard + (k < loop % shard);
+    fflush(stdout);
+    if (fork() == 0) {
+      srand(seed + k);
+      FILE *out = fopen(out_file[k], "w");
+      assert(out != NULL);
+      run_shard(n, out);
+      fclose(out);
+      exit(0);
+    }
+  }
+  while (wait(NULL) > 0);
 
-    printf("%u %s\n", result, buf);
+  for (int k = 0; k < shard; k ++) {
+    FILE *fp = fopen(out_file[k], "r");
+    if (fp == NULL) continue;
+    char line[4096];
+    size_t len;
+    while ((len = fread(line, 1, sizeof(line), fp)) > 0) fwrite(line, 1, len, stdout);
+    fclose(fp);
+    unlink(out_file[k]);
   }
   return 0;
 }
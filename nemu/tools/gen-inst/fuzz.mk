@@ -0,0 +1,35 @@
+#***************************************************************************************
+# Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# Run FUZZ_NR random programs with seeds starting from FUZZ_SEED through NEMU.
+# Each program is a separate target, so they run in parallel with `make -j'.
+# The image and the log of a failed program are kept in FUZZ_DIR.
+
+GEN_INST = $(NEMU_HOME)/tools/gen-inst/build/gen-inst
+SEEDS = $(shell seq $(FUZZ_SEED) $$(($(FUZZ_SEED) + $(FUZZ_NR) - 1)))
+RESULTS = $(SEEDS:%=$(FUZZ_DIR)/%.result)
+
+fuzz: $(RESULTS)
+	@echo "$$(grep -l FAIL $(FUZZ_DIR)/*.result | wc -l) of $(FUZZ_NR) programs failed"
+
+$(FUZZ_DIR)/%.result:
+	@$(GEN_INST) -s $* -n $(FUZZ_LEN) $(FUZZ_FLAGS) $(FUZZ_DIR)/$*.bin
+	@if $(NEMU) -b --log=$(FUZZ_DIR)/$*.log $(FUZZ_DIR)/$*.bin > /dev/null 2>&1; then \
+	  echo PASS > $@; rm $(FUZZ_DIR)/$*.bin $(FUZZ_DIR)/$*.log; \
+	else \
+	  echo FAIL > $@; echo "seed $* failed, see $(FUZZ_DIR)/$*.log"; \
+	fi
+
+.PHONY: fuzz
@@ -0,0 +1,219 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <assert.h>
+#include <getopt.h>
+
+/* Generate a random but valid riscv32 program as a raw binary image loaded
+ * at the reset vector. The program
+ *   - initializes the registers with random and corner values,
+ *   - runs random RV32I (and optionally M) instructions,
+ *   - only accesses the data area pointed by `t6', with aligned addresses,
+ *   - only jumps forward, so it always terminates,
+ *   - ends with `li a0, 0; ebreak' to hit the good trap of NEMU.
+ * Registers `t5' and `t6' are reserved and never written by the random part.
+ */
+
+#define MAX_INST 65536
+#define DATA_BASE 0x80100000u // should not overlap with the code
+#define DATA_SIZE 2048        // reachable by the 12-bit offset from `t6'
+#define MAX_JUMP 16           // in instructions
+
+enum { R_ZERO = 0, R_A0 = 10, R_T5 = 30, R_T6 = 31 };
+
+static uint32_t code[MAX_INST];
+static int nr_code = 0;
+static bool has_m = false;
+
+static uint32_t rand32() {
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static int choose(int n) {
+  return rand() % n;
+}
+
+// any register but the reserved ones, including x0
+static int rand_rd() { return choose(R_T5); }
+static int rand_rs() { return choose(32); }
+
+static void emit(uint32_t inst) {
+  assert(nr_code < MAX_INST);
+  code[nr_code ++] = inst;
+}
+
+static uint32_t r_type(int funct7, int rs2, int rs1, int funct3, int rd, int opcode) {
+  return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t i_type(int imm, int rs1, int funct3, int rd, int opcode) {
+  return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t s_type(int imm, int rs2, int rs1, int funct3, int opcode) {
+  return (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+    ((imm & 0x1f) << 7) | opcode;
+}
+
+static uint32_t b_type(int imm, int rs2, int rs1, int funct3) {
+  return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) |
+    (funct3 << 12) | (((imm >> 1) & 0xf) << 8) | (((imm >> 11) & 1) << 7) | 0x63;
+}
+
+static uint32_t u_type(uint32_t imm, int rd, int opcode) {
+  return (imm & 0xfffff000u) | (rd << 7) | opcode;
+}
+
+static uint32_t j_type(int imm, int rd) {
+  return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+    (((imm >> 12) & 0xff) << 12) | (rd << 7) | 0x6f;
+}
+
+static void emit_li(int rd, uint32_t val) {
+  uint32_t lo = val & 0xfff;
+  uint32_t hi = val + ((lo & 0x800) << 1); // compensate the sign extension of addi
+  emit(u_type(hi, rd, 0x37));
+  emit(i_type(lo, rd, 0, rd, 0x13));
+}
+
+static uint32_t rand_value() {
+  static const uint32_t corner[] = {
+    0, 1, 2, 0xffffffff, 0xfffffffe, 0x80000000, 0x7fffffff, 0x80000001, 0xffff, 0x10000, 31, 32,
+  };
+  return (choose(3) == 0 ? corner[choose(sizeof(corner) / sizeof(corner[0]))] : rand32());
+}
+
+// jump forward by 1 to MAX_JUMP instructions, but not beyond `end'
+static int rand_jump(int end) {
+  int room = end - nr_code;
+  int k = 1 + choose(room < MAX_JUMP ? room : MAX_JUMP);
+  return k * 4;
+}
+
+static void gen_op() {
+  static const int funct3_funct7[][2] = {
+    {0, 0x00}, {0, 0x20}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0x00}, {5, 0x20}, {6, 0}, {7, 0},
+  };
+  int funct3, funct7;
+  if (has_m && choose(3) == 0) { funct3 = choose(8); funct7 = 0x01; }
+  else {
+    int i = choose(sizeof(funct3_funct7) / sizeof(funct3_funct7[0]));
+    funct3 = funct3_funct7[i][0];
+    funct7 = funct3_funct7[i][1];
+  }
+  emit(r_type(funct7, rand_rs(), rand_rs(), funct3, rand_rd(), 0x33));
+}
+
+static void gen_op_imm() {
+  int funct3 = choose(8);
+  int imm = rand32() & 0xfff;
+  if (funct3 == 1) imm &= 0x1f;                                         // slli
+  else if (funct3 == 5) imm = (imm & 0x1f) | (choose(2) ? 0x400 : 0); // srli, srai
+  emit(i_type(imm, rand_rs(), funct3, rand_rd(), 0x13));
+}
+
+static void gen_load() {
+  static const int funct3[] = { 0, 1, 2, 4, 5 }; // lb, lh, lw, lbu, lhu
+  int f = funct3[choose(5)];
+  int align = 1 << (f & 3);
+  emit(i_type(choose(DATA_SIZE / align) * align, R_T6, f, rand_rd(), 0x03));
+}
+
+static void gen_store() {
+  int f = choose(3); // sb, sh, sw
+  int align = 1 << f;
+  emit(s_type(choose(DATA_SIZE / align) * align, rand_rs(), R_T6, f, 0x23));
+}
+
+static void gen_branch(int end) {
+  static const int funct3[] = { 0, 1, 4, 5, 6, 7 };
+  emit(b_type(rand_jump(end), rand_rs(), rand_rs(), funct3[choose(6)]));
+}
+
+static void gen_jal(int end) {
+  emit(j_type(rand_jump(end), rand_rd()));
+}
+
+// auipc t5, 0; jalr rd, off(t5)
+static void gen_jalr(int end) {
+  emit(u_type(0, R_T5, 0x17));
+  int off = rand_jump(end) + 4;
+  emit(i_type(off, R_T5, 0, rand_rd(), 0x67));
+}
+
+static void gen_upper() {
+  emit(u_type(rand32(), rand_rd(), choose(2) ? 0x37 : 0x17)); // lui, auipc
+}
+
+static void gen_program(int nr_inst) {
+  emit_li(R_T6, DATA_BASE);
+  for (int i = 1; i < R_T5; i ++) emit_li(i, rand_value());
+
+  // the random part ends at `end', where `li a0, 0' is placed
+  int end = nr_code + nr_inst;
+  assert(end + 2 <= MAX_INST);
+  while (nr_code < end - 1) {
+    switch (choose(16)) {
+      case 0: case 1: case 2: case 3: gen_op(); break;
+      case 4: case 5: case 6: gen_op_imm(); break;
+      case 7: case 8: gen_load(); break;
+      case 9: case 10: gen_store(); break;
+      case 11: case 12: gen_branch(end); break;
+      case 13: gen_jal(end); break;
+      case 14: if (nr_code < end - 2) { gen_jalr(end - 1); break; } // fall through
+      default: gen_upper(); break;
+    }
+  }
+  while (nr_code < end) emit(i_type(0, R_ZERO, 0, R_ZERO, 0x13)); // nop
+
+  emit(i_type(0, R_ZERO, 0, R_A0, 0x13)); // li a0, 0
+  emit(0x00100073); // ebreak
+}
+
+int main(int argc, char *argv[]) {
+  unsigned seed = time(0);
+  int nr_inst = 1000;
+  int o;
+  while ((o = getopt(argc, argv, "s:n:m")) != -1) {
+    switch (o) {
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case 'n': nr_inst = atoi(optarg); break;
+      case 'm': has_m = true; break;
+      default: optind = argc + 1; break;
+    }
+  }
+  if (optind != argc - 1 || nr_inst < 2) {
+    printf("Usage: %s [-s SEED] [-n NR_INST] [-m] IMAGE\n", argv[0]);
+    printf("\t-s SEED     random seed, the same seed generates the same program\n");
+    printf("\t-n NR_INST  number of random instructions, 1000 by default\n");
+    printf("\t-m          also generate instructions in the M extension\n");
+    return 1;
+  }
+
+  srand(seed);
+  gen_program(nr_inst);
+
+  FILE *fp = fopen(argv[optind], "wb");
+  assert(fp != NULL);
+  int ret = fwrite(code, sizeof(code[0]), nr_code, fp);
+  assert(ret == nr_code);
+  fclose(fp);
+  return 0;
+}
@@ -327,6 +327,63 @@ static void kvm_exec(uint64_t n) {
   }
 }
 
+// Run without single-stepping until the instruction at `pc' is about to
+// execute for `nr_hit' times, where the instruction at the current rip is not
+// counted. The hardware breakpoint in DR1 is used, DR0 is left for the
+// handling of interrupts above. Note that pushf/popf are not patched while
+// running freely, so the flags they push may differ from NEMU.
+static void kvm_exec_to(uint64_t pc, uint64_t nr_hit) {
+  if (vcpu.int_wp_state != STATE_IDLE) {
+    // an interrupt is being handled, fall back to single-stepping
+    while (nr_hit > 0) {
+      kvm_exec(1);
+      if (vcpu.kvm_run->exit_reason == KVM_EXIT_HLT) return;
+      if (vcpu.kvm_run->s.regs.regs.rip == pc) nr_hit --;
+    }
+    return;
+  }
+
+  if (vcpu.kvm_run->s.regs.regs.rip == pc) {
+    kvm_exec(1);
+    if (vcpu.kvm_run->s.regs.regs.rip == pc) nr_hit --;
+  }
+  if (nr_hit == 0) return;
+
+  struct kvm_guest_debug debug = {};
+  debug.control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_USE_HW_BP;
+  debug.arch.debugreg[1] = pc;
+  debug.arch.debugreg[7] = 0x4; // L1, watch instruction fetch at `pc'
+  vcpu.kvm_run->s.regs.regs.rflags &= ~RFLAGS_TF;
+  vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+  if (ioctl(vcpu.fd, KVM_SET_GUEST_DEBUG, &debug) < 0) {
+    perror("KVM_SET_GUEST_DEBUG");
+    assert(0);
+  }
+
+  while (nr_hit > 0) {
+    if (ioctl(vcpu.fd, KVM_RUN, 0) < 0) {
+      if (errno == EINTR) continue;
+      perror("KVM_RUN");
+      assert(0);
+    }
+    if (vcpu.kvm_run->exit_reason == KVM_EXIT_HLT) break;
+    Assert(vcpu.kvm_run->exit_reason == KVM_EXIT_DEBUG,
+        "Got exit_reason %d at pc = 0x%llx, expected KVM_EXIT_DEBUG (%d)",
+        vcpu.kvm_run->exit_reason, vcpu.kvm_run->s.regs.regs.rip, KVM_EXIT_DEBUG);
+    if (vcpu.kvm_run->debug.arch.pc == pc) {
+      nr_hit --;
+      // resume from the breakpoint without hitting it again
+      vcpu.kvm_run->s.regs.regs.rflags |= RFLAGS_RF;
+      vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+    }
+  }
+
+  vcpu.kvm_run->s.regs.regs.rflags &= ~RFLAGS_RF;
+  vcpu.kvm_run->s.regs.regs.rflags |= RFLAGS_TF;
+  vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+  kvm_set_step_mode(false, 0);
+}
+
 static void run_protected_mode() {
   struct kvm_sregs sregs;
   kvm_getsregs(&sregs);
@@ -382,6 +439,22 @@ __EXPORT void difftest_exec(uint64_t n) {
   kvm_exec(n);
 }
 
+__EXPORT void difftest_exec_and_regcpy(uint64_t n, void *buf, uint64_t *dirty_mask) {
+  static DIFFTEST_REG_T last[DIFFTEST_NR_REG] = {};
+  DIFFTEST_REG_T now[DIFFTEST_NR_REG];
+  kvm_exec(n);
+  difftest_regcpy(now, DIFFTEST_TO_DUT);
+  *dirty_mask = difftest_pack_regs(now, last, buf);
+}
+
+__EXPORT void difftest_exec_to(uint64_t pc, uint64_t nr_hit) {
+  kvm_exec_to(pc, nr_hit);
+}
+
+__EXPORT int difftest_version() {
+  return DIFFTEST_ABI_VERSION;
+}
+
 __EXPORT void difftest_raise_intr(word_t NO) {
   uint32_t pgate_vaddr = vcpu.kvm_run->s.regs.sregs.idt.base + NO * 8;
   uint32_t pgate = va2pa(pgate_vaddr);
@@ -401,6 +474,12 @@ __EXPORT void difftest_raise_intr(word_t NO) {
   }
 }
 
+__EXPORT void difftest_memhash(const paddr_t *addr, int nr, uint64_t *hash) {
+  for (int i = 0; i < nr; i ++) {
+    hash[i] = difftest_page_hash(vm.mem + addr[i]);
+  }
+}
+
 __EXPORT void difftest_init(int port) {
   vm_init(CONFIG_MSIZE);
   vcpu_init();
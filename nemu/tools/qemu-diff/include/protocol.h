@@ -17,7 +17,12 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 struct gdb_conn;
 
@@ -28,6 +33,10 @@ uint8_t hex_encode(uint8_t digit);
 
 struct gdb_conn *gdb_begin_inet(const char *addr, uint16_t port);
 
+struct gdb_conn *gdb_begin_server_inet(uint16_t port);
+
+struct gdb_conn *gdb_begin_server_unix(const char *path);
+
 void gdb_end(struct gdb_conn *conn);
 
 void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size);
@@ -35,3 +44,7 @@ void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size);
 uint8_t *gdb_recv(struct gdb_conn *conn, size_t *size);
 
 const char * gdb_start_noack(struct gdb_conn *conn);
+
+bool gdb_poll_interrupt(struct gdb_conn *conn);
+
+#endif
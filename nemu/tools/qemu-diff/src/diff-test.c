@@ -18,21 +18,27 @@
 #include <sys/prctl.h>
 #include <signal.h>
 
+// instructions in a straight line shorter than this are single-stepped
+#define MIN_RUN 4
+#define MAX_RUN 256
+
 bool gdb_connect_qemu(int);
 bool gdb_memcpy_to_qemu(uint32_t, void *, int);
+bool gdb_memcpy_from_qemu(uint32_t, void *, int);
 bool gdb_getregs(union isa_gdb_regs *);
 bool gdb_setregs(union isa_gdb_regs *);
 bool gdb_si();
+bool gdb_run_to(uint32_t, uint32_t);
 void gdb_exit();
 
 void init_isa();
+int isa_straight_line(int max, uint32_t *pc);
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(direction == DIFFTEST_TO_REF);
-  if (direction == DIFFTEST_TO_REF) {
-    bool ok = gdb_memcpy_to_qemu(addr, buf, n);
-    assert(ok == 1);
-  }
+  bool ok;
+  if (direction == DIFFTEST_TO_REF) ok = gdb_memcpy_to_qemu(addr, buf, n);
+  else ok = gdb_memcpy_from_qemu(addr, buf, n);
+  assert(ok == 1);
 }
 
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
@@ -46,8 +52,40 @@ __EXPORT void difftest_regcpy(void *dut, bool direction) {
   }
 }
 
+// Single-stepping costs a round trip per instruction. Instructions which
+// surely fall through are run together to a temporary breakpoint (or with
+// range stepping), and the instruction ending the straight line is stepped.
 __EXPORT void difftest_exec(uint64_t n) {
-  while (n --) gdb_si();
+  while (n > 0) {
+    int max = (n < MAX_RUN ? n : MAX_RUN);
+    uint32_t pc = 0;
+    int k = (max >= MIN_RUN ? isa_straight_line(max, &pc) : 0);
+    if (k >= MIN_RUN) gdb_run_to(pc, pc + k * 4);
+    else for (int i = 0; i < k; i ++) gdb_si();
+    if (k < max) { gdb_si(); k ++; }
+    n -= k;
+  }
+}
+
+__EXPORT void difftest_memhash(const paddr_t *addr, int nr, uint64_t *hash) {
+  static uint8_t page[DIFFTEST_PAGE_SIZE];
+  for (int i = 0; i < nr; i ++) {
+    bool ok = gdb_memcpy_from_qemu(addr[i], page, DIFFTEST_PAGE_SIZE);
+    assert(ok == 1);
+    hash[i] = difftest_page_hash(page);
+  }
+}
+
+__EXPORT void difftest_exec_and_regcpy(uint64_t n, void *buf, uint64_t *dirty_mask) {
+  static DIFFTEST_REG_T last[DIFFTEST_NR_REG] = {};
+  union isa_gdb_regs qemu_r;
+  difftest_exec(n);
+  gdb_getregs(&qemu_r);
+  *dirty_mask = difftest_pack_regs((DIFFTEST_REG_T *)&qemu_r, last, buf);
+}
+
+__EXPORT int difftest_version() {
+  return DIFFTEST_ABI_VERSION;
 }
 
 __EXPORT void difftest_init(int port) {
@@ -15,7 +15,44 @@
 
 #include "common.h"
 
+// number of M packets on the fly when the server accepts the no-ack mode
+#define MEMCPY_WINDOW 16
+
 static struct gdb_conn *conn;
+static bool noack = false;
+static bool has_range_step = false;
+static int mtu = 1500; // bytes of memory in a single m/M packet
+
+// the register image in QEMU, valid until QEMU executes again
+static union isa_gdb_regs reg_cache;
+static bool reg_cache_valid = false;
+
+static uint8_t* gdb_recv_reply() {
+  size_t size;
+  return gdb_recv(conn, &size);
+}
+
+static uint8_t* gdb_query(const char *cmd) {
+  gdb_send(conn, (const uint8_t *)cmd, strlen(cmd));
+  return gdb_recv_reply();
+}
+
+static void gdb_probe_features() {
+  uint8_t *reply = gdb_query("qSupported");
+  char *p = strstr((char *)reply, "PacketSize=");
+  if (p != NULL) {
+    // leave space for the command, the address and the length
+    int size = strtol(p + 11, NULL, 16);
+    if ((size - 32) / 2 < mtu) mtu = (size - 32) / 2;
+  }
+  free(reply);
+
+  reply = gdb_query("vCont?");
+  for (char *q = strchr((char *)reply, ';'); q != NULL; q = strchr(q + 1, ';')) {
+    if (q[1] == 'r') has_range_step = true;
+  }
+  free(reply);
+}
 
 bool gdb_connect_qemu(int port) {
   // connect to gdbserver on localhost port 1234
@@ -23,43 +60,80 @@ bool gdb_connect_qemu(int port) {
     usleep(1);
   }
 
+  // no-ack mode saves a round trip per packet, and allows pipelining
+  noack = !strcmp(gdb_start_noack(conn), "OK");
+  gdb_probe_features();
+
   return true;
 }
 
-static bool gdb_memcpy_to_qemu_small(uint32_t dest, void *src, int len) {
-  char *buf = malloc(len * 2 + 128);
-  assert(buf != NULL);
-  int p = sprintf(buf, "M0x%x,%x:", dest, len);
-  int i;
-  for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
+static char* encode_hex(char *p, const uint8_t *src, int len) {
+  for (int i = 0; i < len; i ++) {
+    *p ++ = hex_encode(src[i] >> 4);
+    *p ++ = hex_encode(src[i] & 0xf);
   }
+  return p;
+}
 
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
-  free(buf);
+static void gdb_send_memcpy_small(uint32_t dest, void *src, int len, char *buf) {
+  int p = sprintf(buf, "M0x%x,%x:", dest, len);
+  char *end = encode_hex(buf + p, src, len);
+  gdb_send(conn, (const uint8_t *)buf, end - buf);
+}
 
-  size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
+static bool gdb_recv_ok() {
+  uint8_t *reply = gdb_recv_reply();
   bool ok = !strcmp((const char*)reply, "OK");
   free(reply);
-
   return ok;
 }
 
 bool gdb_memcpy_to_qemu(uint32_t dest, void *src, int len) {
-  const int mtu = 1500;
+  char *buf = malloc(mtu * 2 + 128);
+  assert(buf != NULL);
+  int window = (noack ? MEMCPY_WINDOW : 1);
+  int inflight = 0;
   bool ok = true;
-  while (len > mtu) {
-    ok &= gdb_memcpy_to_qemu_small(dest, src, mtu);
-    dest += mtu;
-    src += mtu;
-    len -= mtu;
+  while (len > 0) {
+    int n = (len > mtu ? mtu : len);
+    gdb_send_memcpy_small(dest, src, n, buf);
+    if (++ inflight == window) { ok &= gdb_recv_ok(); inflight --; }
+    dest += n;
+    src += n;
+    len -= n;
+  }
+  while (inflight -- > 0) ok &= gdb_recv_ok();
+  free(buf);
+  return ok;
+}
+
+bool gdb_memcpy_from_qemu(uint32_t src, void *dest, int len) {
+  char cmd[64];
+  bool ok = true;
+  while (len > 0) {
+    int n = (len > mtu ? mtu : len);
+    sprintf(cmd, "m0x%x,%x", src, n);
+    uint8_t *reply = gdb_query(cmd);
+    if (strlen((char *)reply) < n * 2) ok = false;
+    else {
+      for (int i = 0; i < n; i ++) {
+        ((uint8_t *)dest)[i] = gdb_decode_hex(reply[2 * i], reply[2 * i + 1]);
+      }
+    }
+    free(reply);
+    src += n;
+    dest += n;
+    len -= n;
   }
-  ok &= gdb_memcpy_to_qemu_small(dest, src, len);
   return ok;
 }
 
 bool gdb_getregs(union isa_gdb_regs *r) {
+  if (reg_cache_valid) {
+    *r = reg_cache;
+    return true;
+  }
+
   gdb_send(conn, (const uint8_t *)"g", 1);
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
@@ -77,30 +151,26 @@ bool gdb_getregs(union isa_gdb_regs *r) {
 
   free(reply);
 
+  reg_cache = *r;
+  reg_cache_valid = true;
   return true;
 }
 
 bool gdb_setregs(union isa_gdb_regs *r) {
+  if (reg_cache_valid && memcmp(r, &reg_cache, sizeof(reg_cache)) == 0) return true;
+
   int len = sizeof(union isa_gdb_regs);
   char *buf = malloc(len * 2 + 128);
   assert(buf != NULL);
   buf[0] = 'G';
+  char *end = encode_hex(buf + 1, (uint8_t *)r, len);
 
-  void *src = r;
-  int p = 1;
-  int i;
-  for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
-  }
-
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  gdb_send(conn, (const uint8_t *)buf, end - buf);
   free(buf);
 
-  size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
-  free(reply);
-
+  bool ok = gdb_recv_ok();
+  reg_cache = *r;
+  reg_cache_valid = ok;
   return ok;
 }
 
@@ -110,9 +180,35 @@ bool gdb_si() {
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
   free(reply);
+  reg_cache_valid = false;
   return true;
 }
 
+// Run from `pc' until reaching `end'. The caller should guarantee that
+// the instructions in between fall through without any exception.
+bool gdb_run_to(uint32_t pc, uint32_t end) {
+  char buf[128];
+  bool ok = true;
+  if (has_range_step) {
+    sprintf(buf, "vCont;r%x,%x:1", pc, end);
+    free(gdb_query(buf));
+  } else {
+    // temporary breakpoint, Z0 and c are pipelined without ack, but
+    // z0 should wait for the stop, since QEMU drops packets when running
+    sprintf(buf, "Z0,%x,4", end);
+    gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+    if (!noack) ok &= gdb_recv_ok();
+    gdb_send(conn, (const uint8_t *)"c", 1);
+    if (noack) ok &= gdb_recv_ok();
+    free(gdb_recv_reply());
+    sprintf(buf, "z0,%x,4", end);
+    gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+    ok &= gdb_recv_ok();
+  }
+  reg_cache_valid = false;
+  return ok;
+}
+
 void gdb_exit() {
   gdb_end(conn);
 }
@@ -76,3 +76,63 @@ void init_isa() {
 }
 
 #endif
+
+#if defined(CONFIG_ISA_mips32) || (defined(CONFIG_ISA_riscv) && !defined(CONFIG_RV64))
+
+bool gdb_memcpy_from_qemu(uint32_t, void *, int);
+bool gdb_getregs(union isa_gdb_regs *);
+
+// whether `inst' surely falls through to the next instruction without any exception
+static bool inst_fall_through(uint32_t inst) {
+#if defined(CONFIG_ISA_mips32)
+  uint32_t funct = inst & 0x3f;
+  switch (inst >> 26) {
+    case 0x00: // SPECIAL
+      switch (funct) {
+        case 0x00: case 0x02: case 0x03: case 0x04: case 0x06: case 0x07: // shift
+        case 0x0a: case 0x0b:                                             // movz, movn
+        case 0x10: case 0x11: case 0x12: case 0x13:                       // mfhi, mthi, mflo, mtlo
+        case 0x18: case 0x19: case 0x1a: case 0x1b:                       // mult, multu, div, divu
+        case 0x21: case 0x23: case 0x24: case 0x25: case 0x26: case 0x27: // addu, subu, and, or, xor, nor
+        case 0x2a: case 0x2b:                                             // slt, sltu
+          return true;
+        default: return false; // jumps, add/sub with overflow, syscall, break, ...
+      }
+    case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d: case 0x0e: case 0x0f:
+      return true; // addiu, slti, sltiu, andi, ori, xori, lui
+    case 0x1c: return funct == 0x02; // mul
+    default: return false;
+  }
+#else
+  uint32_t funct3 = (inst >> 12) & 0x7, funct7 = inst >> 25;
+  switch (inst & 0x7f) {
+    case 0x37: case 0x17: return true; // lui, auipc
+    case 0x13: // OP-IMM, the shift amount of slli/srli/srai should be valid
+      if (funct3 == 1) return funct7 == 0x00;
+      if (funct3 == 5) return funct7 == 0x00 || funct7 == 0x20;
+      return true;
+    case 0x33: // OP, including the M extension
+      return funct7 == 0x00 || funct7 == 0x01 || (funct7 == 0x20 && (funct3 == 0 || funct3 == 5));
+    default: return false;
+  }
+#endif
+}
+
+int isa_straight_line(int max, uint32_t *pc) {
+  union isa_gdb_regs r;
+  uint32_t inst[max];
+  gdb_getregs(&r);
+  *pc = r.pc;
+  if (!gdb_memcpy_from_qemu(r.pc, inst, max * sizeof(inst[0]))) return 0;
+  int n;
+  for (n = 0; n < max && inst_fall_through(inst[n]); n ++);
+  return n;
+}
+
+#else
+
+int isa_straight_line(int max, uint32_t *pc) {
+  return 0;
+}
+
+#endif
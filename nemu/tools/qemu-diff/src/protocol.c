@@ -17,9 +17,15 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
 #include <ctype.h>
 #include <err.h>
+#include <poll.h>
+#include "protocol.h"
 
 #include <arpa/inet.h>
 
@@ -28,6 +34,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 struct gdb_conn {
   FILE *in;
@@ -129,6 +136,53 @@ struct gdb_conn* gdb_begin_inet(const char *addr, uint16_t port) {
 }
 
 
+static int gdb_accept(int lfd) {
+  if (listen(lfd, 1) != 0)
+    err(1, "listen");
+  int fd = accept(lfd, NULL, NULL);
+  if (fd < 0)
+    err(1, "accept");
+  close(lfd);
+  return fd;
+}
+
+struct gdb_conn* gdb_begin_server_inet(uint16_t port) {
+  struct sockaddr_in sa = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lfd < 0)
+    err(1, "socket");
+  int tmp = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (char *)&tmp, sizeof(tmp));
+  if (bind(lfd, (const struct sockaddr *)&sa, sizeof(sa)) != 0)
+    err(1, "bind");
+
+  int fd = gdb_accept(lfd);
+  tmp = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&tmp, sizeof(tmp));
+  return gdb_begin(fd);
+}
+
+struct gdb_conn* gdb_begin_server_unix(const char *path) {
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(sa.sun_path))
+    errx(1, "Socket path too long: %s", path);
+  strcpy(sa.sun_path, path);
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0)
+    err(1, "socket");
+  unlink(path);
+  if (bind(lfd, (const struct sockaddr *)&sa, sizeof(sa)) != 0)
+    err(1, "bind");
+
+  return gdb_begin(gdb_accept(lfd));
+}
+
 void gdb_end(struct gdb_conn *conn) {
   fclose(conn->in);
   fclose(conn->out);
@@ -303,3 +357,17 @@ const char* gdb_start_noack(struct gdb_conn *conn) {
     conn->ack = false;
   return ok ? "OK" : "";
 }
+
+bool gdb_poll_interrupt(struct gdb_conn *conn) {
+  // the interrupt request (^C) is sent out of band, without packet framing
+  struct pollfd pfd = { .fd = fileno(conn->in), .events = POLLIN };
+  if (poll(&pfd, 1, 0) <= 0)
+    return false;
+
+  int c = fgetc(conn->in);
+  if (c == 0x03)
+    return true;
+  if (c != EOF)
+    ungetc(c, conn->in);
+  return false;
+}
@@ -0,0 +1,267 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <assert.h>
+#include <getopt.h>
+
+/* Choose the representative intervals from the basic-block vectors written
+ * by NEMU with `--bbv', in the way of SimPoint:
+ *   - each vector is normalized, and projected to a few random dimensions,
+ *   - the vectors are clustered by k-means for k = 1 .. MAXK,
+ *   - the smallest k whose BIC reaches 90% of the range of the BIC scores
+ *     is taken,
+ *   - the interval closest to the center of each cluster represents it,
+ *     weighted by the size of the cluster.
+ * The results are written to PREFIX.simpoints, as `interval cluster' lines
+ * for `--simpoint' of NEMU, and PREFIX.weights, as `weight cluster' lines.
+ */
+
+#define NR_TRY 5
+#define MAX_ITER 100
+#define BIC_THRESHOLD 0.9
+
+static int nr_dim = 15;
+static int max_k = 30;
+static uint64_t seed = 1;
+
+static double *point = NULL; // nr_point x nr_dim
+static int nr_point = 0;
+
+static int *assign = NULL, *best_assign = NULL;
+static double *center = NULL, *best_center = NULL;
+
+// a random value in [-1, 1) for each pair of a basic block and a dimension
+static double proj(uint64_t id, int d) {
+  uint64_t z = seed + id * 0x9e3779b97f4a7c15ull + d * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  return (z >> 11) * (2.0 / (1ull << 53)) - 1.0;
+}
+
+static void load(const char *file) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) { printf("Can not open '%s'\n", file); exit(1); }
+  int max = 0;
+  int c;
+  while ((c = fgetc(fp)) != EOF) {
+    if (c != 'T') continue;
+    if (nr_point == max) {
+      max = (max == 0 ? 1024 : max * 2);
+      point = realloc(point, sizeof(double) * nr_dim * max);
+      assert(point);
+    }
+    double *p = &point[nr_point * nr_dim];
+    memset(p, 0, sizeof(double) * nr_dim);
+    uint64_t id, count, total = 0;
+    while (fscanf(fp, " :%" SCNu64 ":%" SCNu64, &id, &count) == 2) {
+      for (int d = 0; d < nr_dim; d ++) p[d] += proj(id, d) * count;
+      total += count;
+    }
+    if (total > 0) {
+      for (int d = 0; d < nr_dim; d ++) p[d] /= total;
+    }
+    nr_point ++;
+  }
+  fclose(fp);
+}
+
+static double dist2(const double *a, const double *b) {
+  double s = 0;
+  for (int d = 0; d < nr_dim; d ++) s += (a[d] - b[d]) * (a[d] - b[d]);
+  return s;
+}
+
+// k-means++ seeding
+static void init_center(int k) {
+  double *w = malloc(sizeof(double) * nr_point);
+  assert(w);
+  memcpy(&center[0], &point[(lrand48() % nr_point) * nr_dim], sizeof(double) * nr_dim);
+  for (int i = 0; i < nr_point; i ++) w[i] = DBL_MAX;
+  for (int c = 1; c < k; c ++) {
+    double sum = 0;
+    for (int i = 0; i < nr_point; i ++) {
+      double d = dist2(&point[i * nr_dim], &center[(c - 1) * nr_dim]);
+      if (d < w[i]) w[i] = d;
+      sum += w[i];
+    }
+    double r = drand48() * sum;
+    int i = 0;
+    for (; i < nr_point - 1 && r >= w[i]; i ++) r -= w[i];
+    memcpy(&center[c * nr_dim], &point[i * nr_dim], sizeof(double) * nr_dim);
+  }
+  free(w);
+}
+
+// return the sum of squared distances to the centers
+static double kmeans(int k) {
+  int *size = calloc(k, sizeof(int));
+  assert(size);
+  init_center(k);
+  double sse = 0;
+  for (int iter = 0; iter < MAX_ITER; iter ++) {
+    int changed = 0;
+    sse = 0;
+    for (int i = 0; i < nr_point; i ++) {
+      int best = 0;
+      double best_d = DBL_MAX;
+      for (int c = 0; c < k; c ++) {
+        double d = dist2(&point[i * nr_dim], &center[c * nr_dim]);
+        if (d < best_d) { best_d = d; best = c; }
+      }
+      if (iter == 0 || assign[i] != best) changed = 1;
+      assign[i] = best;
+      sse += best_d;
+    }
+    if (!changed) break;
+
+    // an empty cluster keeps its center
+    memset(size, 0, sizeof(int) * k);
+    for (int i = 0; i < nr_point; i ++) size[assign[i]] ++;
+    for (int c = 0; c < k; c ++) {
+      if (size[c] > 0) memset(&center[c * nr_dim], 0, sizeof(double) * nr_dim);
+    }
+    for (int i = 0; i < nr_point; i ++) {
+      for (int d = 0; d < nr_dim; d ++) center[assign[i] * nr_dim + d] += point[i * nr_dim + d];
+    }
+    for (int c = 0; c < k; c ++) {
+      for (int d = 0; d < nr_dim && size[c] > 0; d ++) center[c * nr_dim + d] /= size[c];
+    }
+  }
+  free(size);
+  return sse;
+}
+
+// the Bayesian information criterion of the best clustering, as in X-means
+static double bic(int k, double sse) {
+  double R = nr_point, M = nr_dim;
+  double var = (nr_point > k ? sse / (R - k) : 0);
+  if (var < 1e-12) var = 1e-12;
+  int *size = calloc(k, sizeof(int));
+  assert(size);
+  for (int i = 0; i < nr_point; i ++) size[best_assign[i]] ++;
+  double l = 0;
+  for (int c = 0; c < k; c ++) {
+    double n = size[c];
+    if (n == 0) continue;
+    l += -n / 2 * log(2 * M_PI) - n * M / 2 * log(var) - (n - k) / 2 + n * log(n) - n * log(R);
+  }
+  free(size);
+  double nr_param = (k - 1) + M * k + 1;
+  return l - nr_param / 2 * log(R);
+}
+
+static double cluster(int k) {
+  double best = DBL_MAX;
+  for (int t = 0; t < NR_TRY; t ++) {
+    double sse = kmeans(k);
+    if (sse < best) {
+      best = sse;
+      memcpy(best_assign, assign, sizeof(int) * nr_point);
+      memcpy(best_center, center, sizeof(double) * nr_dim * k);
+    }
+  }
+  return bic(k, best);
+}
+
+static void output(const char *prefix, int k) {
+  char file[strlen(prefix) + 16];
+  sprintf(file, "%s.simpoints", prefix);
+  FILE *sp = fopen(file, "w");
+  sprintf(file, "%s.weights", prefix);
+  FILE *wt = fopen(file, "w");
+  assert(sp && wt);
+  int id = 0;
+  for (int c = 0; c < k; c ++) {
+    int size = 0, rep = -1;
+    double rep_d = DBL_MAX;
+    for (int i = 0; i < nr_point; i ++) {
+      if (best_assign[i] != c) continue;
+      size ++;
+      double d = dist2(&point[i * nr_dim], &best_center[c * nr_dim]);
+      if (d < rep_d) { rep_d = d; rep = i; }
+    }
+    if (size == 0) continue;
+    fprintf(sp, "%d %d\n", rep, id);
+    fprintf(wt, "%.6f %d\n", (double)size / nr_point, id);
+    printf("cluster %d: interval %d, weight %.6f\n", id, rep, (double)size / nr_point);
+    id ++;
+  }
+  fclose(sp);
+  fclose(wt);
+}
+
+int main(int argc, char *argv[]) {
+  int o;
+  while ((o = getopt(argc, argv, "k:d:s:")) != -1) {
+    switch (o) {
+      case 'k': max_k = atoi(optarg); break;
+      case 'd': nr_dim = atoi(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      default: optind = argc + 1; break;
+    }
+  }
+  if (optind != argc - 1 && optind != argc - 2) optind = argc + 1;
+  if (optind > argc || max_k < 1 || nr_dim < 1) {
+    printf("Usage: %s [-k MAXK] [-d DIM] [-s SEED] BBV_FILE [PREFIX]\n", argv[0]);
+    printf("\t-k MAXK  try clusterings with up to MAXK clusters, 30 by default\n");
+    printf("\t-d DIM   number of dimensions of the random projection, 15 by default\n");
+    printf("\t-s SEED  random seed of the projection and k-means, 1 by default\n");
+    printf("\tPREFIX   prefix of the output files, BBV_FILE by default\n");
+    return 1;
+  }
+  const char *bbv_file = argv[optind];
+  const char *prefix = (optind == argc - 2 ? argv[optind + 1] : bbv_file);
+
+  load(bbv_file);
+  if (nr_point == 0) { printf("No vector is found in '%s'\n", bbv_file); return 1; }
+  if (max_k > nr_point) max_k = nr_point;
+  srand48(seed);
+
+  assign = malloc(sizeof(int) * nr_point);
+  best_assign = malloc(sizeof(int) * nr_point);
+  center = malloc(sizeof(double) * nr_dim * max_k);
+  best_center = malloc(sizeof(double) * nr_dim * max_k);
+  double *score = malloc(sizeof(double) * (max_k + 1));
+  assert(assign && best_assign && center && best_center && score);
+
+  // keep the clustering of every k, until one is chosen
+  int *all_assign = malloc(sizeof(int) * nr_point * (max_k + 1));
+  double *all_center = malloc(sizeof(double) * nr_dim * max_k * (max_k + 1));
+  assert(all_assign && all_center);
+
+  double lo = DBL_MAX, hi = -DBL_MAX;
+  for (int k = 1; k <= max_k; k ++) {
+    score[k] = cluster(k);
+    if (score[k] < lo) lo = score[k];
+    if (score[k] > hi) hi = score[k];
+    memcpy(&all_assign[nr_point * k], best_assign, sizeof(int) * nr_point);
+    memcpy(&all_center[nr_dim * max_k * k], best_center, sizeof(double) * nr_dim * k);
+  }
+  int k = 1;
+  while (k < max_k && score[k] < lo + BIC_THRESHOLD * (hi - lo)) k ++;
+  printf("%d intervals, %d clusters are chosen\n", nr_point, k);
+
+  memcpy(best_assign, &all_assign[nr_point * k], sizeof(int) * nr_point);
+  memcpy(best_center, &all_center[nr_dim * max_k * k], sizeof(double) * nr_dim * k);
+  output(prefix, k);
+  return 0;
+}
@@ -70,20 +70,56 @@ void sim_t::diff_set_regs(void* diff_context) {
   state->pc = ctx->pc;
 }
 
+static bool in_dram(reg_t addr, size_t n) {
+  return addr >= DRAM_BASE && addr - DRAM_BASE + n <= CONFIG_MSIZE;
+}
+
+// copy between `buf' and the backing store of the memory directly,
+// page by page, since pages are allocated by spike on demand
+static void dram_copy(reg_t addr, void *buf, size_t n, bool direction) {
+  mem_t *mem = difftest_mem[0].second;
+  uint8_t *b = (uint8_t *)buf;
+  while (n > 0) {
+    reg_t off = addr - DRAM_BASE;
+    size_t len = std::min<size_t>(n, PGSIZE - off % PGSIZE);
+    if (direction == DIFFTEST_TO_REF) memcpy(mem->contents(off), b, len);
+    else memcpy(b, mem->contents(off), len);
+    addr += len; b += len; n -= len;
+  }
+}
+
 void sim_t::diff_memcpy(reg_t dest, void* src, size_t n) {
   mmu_t* mmu = p->get_mmu();
+  if (in_dram(dest, n)) {
+    dram_copy(dest, src, n, DIFFTEST_TO_REF);
+    // instructions decoded from the old content should be dropped
+    mmu->flush_icache();
+    mmu->flush_tlb();
+    return;
+  }
   for (size_t i = 0; i < n; i++) {
     mmu->store<uint8_t>(dest+i, *((uint8_t*)src+i));
   }
 }
 
+static void diff_memcpy_to_dut(reg_t src, void* dest, size_t n) {
+  if (in_dram(src, n)) {
+    dram_copy(src, dest, n, DIFFTEST_TO_DUT);
+    return;
+  }
+  mmu_t* mmu = p->get_mmu();
+  for (size_t i = 0; i < n; i++) {
+    *((uint8_t*)dest+i) = mmu->load<uint8_t>(src+i);
+  }
+}
+
 extern "C" {
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     s->diff_memcpy(addr, buf, n);
   } else {
-    assert(0);
+    diff_memcpy_to_dut(addr, buf, n);
   }
 }
 
@@ -99,6 +135,28 @@ __EXPORT void difftest_exec(uint64_t n) {
   s->diff_step(n);
 }
 
+__EXPORT void difftest_memhash(const paddr_t *addr, int nr, uint64_t *hash) {
+  static_assert(PGSIZE == DIFFTEST_PAGE_SIZE, "page size of spike should match difftest");
+  mem_t *mem = difftest_mem[0].second;
+  for (int i = 0; i < nr; i ++) {
+    // pages are allocated by spike on demand, so read them through the backing memory
+    hash[i] = difftest_page_hash(mem->contents(addr[i] - DRAM_BASE));
+  }
+}
+
+__EXPORT void difftest_exec_and_regcpy(uint64_t n, void *buf, uint64_t *dirty_mask) {
+  static DIFFTEST_REG_T last[DIFFTEST_NR_REG] = {};
+  static_assert(sizeof(diff_context_t) == DIFFTEST_REG_SIZE, "diff_context_t should match the register image");
+  diff_context_t now;
+  s->diff_step(n);
+  s->diff_get_regs(&now);
+  *dirty_mask = difftest_pack_regs((DIFFTEST_REG_T *)&now, last, (DIFFTEST_REG_T *)buf);
+}
+
+__EXPORT int difftest_version() {
+  return DIFFTEST_ABI_VERSION;
+}
+
 __EXPORT void difftest_init(int port) {
   difftest_htif_args.push_back("");
   const char *isa = "RV" MUXDEF(CONFIG_RV64, "64", "32") MUXDEF(CONFIG_RVE, "E", "I") "MAFDC";